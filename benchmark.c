@@ -0,0 +1,375 @@
+/*
+ * benchmark.c
+ *
+ * Copyright (C) 2019 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * time the filters on a fixed buffer
+ *
+ * benchmark
+ *
+ * - maximal, boost and valley by scanning the whole window at each value,
+ *   like it was done before the sliding window, and by the sliding window,
+ *   for windows from 11 to 1024 values; the outputs are checked equal
+ * - diff, amplify and trigger without vector instructions and with each
+ *   level of them the processor has
+ * - the protocols on runlength values, by interpreting their arrays as it
+ *   was done before they were compiled and by protocols_event(); the number
+ *   of keys of both is printed
+ *
+ * the buffer for the filters is a synthetic capture: noise with bursts of
+ * pulses; the runlength values for the protocols are from a capture of nec
+ * keys with noise in between, plus random values
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "filters.h"
+#include "protocols.h"
+
+#define NVALUES (1 << 21)
+#define REPEAT 20
+
+/*
+ * the fixed buffer
+ */
+void capture(int *values, int n) {
+	unsigned int seed;
+	int i, pulse;
+
+	seed = 1;
+	for (i = 0; i < n; i++) {
+		pulse = (i / 20000) % 2 == 1 && (i / 25) % 2 == 1;
+		values[i] = (pulse ? 9000 : 0) +
+			(int) (rand_r(&seed) % 301) - 150;
+	}
+}
+
+/*
+ * time from start, in nanoseconds per value
+ */
+struct timespec start;
+
+void timestart() {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+double timeper(long n) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start.tv_sec) * 1e9 +
+		(end.tv_nsec - start.tv_nsec)) / n;
+}
+
+/*
+ * maximal, boost and valley by scanning the window, as before the sliding
+ * window
+ */
+struct scan {
+	int size;
+	int pos;
+	int *data;
+};
+
+int scanmaximal(int value, struct scan *b) {
+	int center, max, out, i;
+
+	b->data[b->pos] = value;
+	b->pos = (b->pos + 1) % b->size;
+	max = abs(b->data[0]);
+	for (i = 0; i < b->size; i++)
+		if (max < abs(b->data[i]))
+			max = abs(b->data[i]);
+	center = (b->pos + b->size / 2) % b->size;
+	if (abs(b->data[center]) != max)
+		out = 0;
+	else {
+		out = b->data[center];
+		b->data[center] *= 2;
+	}
+	return out;
+}
+
+int scanboost(int value, struct scan *b) {
+	int max, i;
+
+	b->data[b->pos] = value;
+	b->pos = (b->pos + 1) % b->size;
+	max = abs(b->data[0]);
+	for (i = 0; i < b->size; i++)
+		if (max < abs(b->data[i]))
+			max = abs(b->data[i]);
+	return max;
+}
+
+int scanvalley(int value, struct scan *b) {
+	int before, after, i, c;
+
+	b->data[b->pos] = value;
+	b->pos = (b->pos + 1) % b->size;
+
+	before = 0;
+	after = 0;
+	for (i = 0; i < b->size; i++) {
+		c = abs(b->data[(b->pos + i) % b->size]);
+		if (i < b->size / 2 && before < c)
+			before = c;
+		if (i >= b->size / 2 && after < c)
+			after = c;
+	}
+
+	return before < after ? before : after;
+}
+
+/*
+ * a filter on a window, in both ways
+ */
+struct windowfilter {
+	char *name;
+	int (*scan)(int value, struct scan *b);
+	void *(*init)(int size, struct status *status);
+	int (*block)(int *in, int n, int *out, void *internal,
+		struct status *status);
+	int (*end)(void *internal, struct status *status);
+};
+
+void benchwindow(struct windowfilter *filter, int *input, int n) {
+	int sizes[] = {11, 32, 128, 512, 1024};
+	struct status status;
+	struct scan scan;
+	void *sliding;
+	int *old, *new, s, i, size, equal;
+	double tscan, tsliding;
+
+	old = malloc(n * sizeof(int));
+	new = malloc(n * sizeof(int));
+
+	printf("%s, ns per value\n", filter->name);
+	printf("window\tscan\tsliding\n");
+	for (s = 0; s < (int) (sizeof(sizes) / sizeof(sizes[0])); s++) {
+		size = sizes[s];
+
+		scan.size = size;
+		scan.pos = 0;
+		scan.data = calloc(size, sizeof(int));
+		timestart();
+		for (i = 0; i < n; i++)
+			old[i] = filter->scan(input[i], &scan);
+		tscan = timeper(n);
+		free(scan.data);
+
+		sliding = filter->init(size, &status);
+		timestart();
+		for (i = 0; i < n; i += BLOCKSIZE)
+			filter->block(input + i,
+				n - i < BLOCKSIZE ? n - i : BLOCKSIZE,
+				new + i, sliding, &status);
+		tsliding = timeper(n);
+		filter->end(sliding, &status);
+
+		equal = ! memcmp(old, new, n * sizeof(int));
+		printf("%d\t%.1f\t%.1f%s\n", size, tscan, tsliding,
+			equal ? "" : "\tDIFFER");
+	}
+
+	free(old);
+	free(new);
+}
+
+/*
+ * diff, amplify and trigger at each level of vector instructions
+ */
+void benchsimd(int *input, int n) {
+	struct status status;
+	void *diff, *amplify, *trigger;
+	int *values, level, top, r, i, m;
+	double tdiff, tamplify, ttrigger;
+
+	values = malloc(n * sizeof(int));
+	top = filters_simd(-1);
+
+	printf("diff, amplify, trigger, ns per value\n");
+	printf("level\tdiff\tamplify\ttrigger\n");
+	for (level = 0; level <= top; level++) {
+		filters_simd(level);
+		diff = diff_init(&status);
+		amplify = amplify_init(-1.5, &status);
+		trigger = trigger_init(1000, &status);
+		tdiff = tamplify = ttrigger = 0;
+		for (r = 0; r < REPEAT; r++) {
+			memcpy(values, input, n * sizeof(int));
+			timestart();
+			for (i = 0; i < n; i += BLOCKSIZE) {
+				m = n - i < BLOCKSIZE ? n - i : BLOCKSIZE;
+				diff_block(values + i, m, values + i,
+					diff, &status);
+			}
+			tdiff += timeper((long) n * REPEAT);
+			timestart();
+			for (i = 0; i < n; i += BLOCKSIZE) {
+				m = n - i < BLOCKSIZE ? n - i : BLOCKSIZE;
+				amplify_block(values + i, m, values + i,
+					amplify, &status);
+			}
+			tamplify += timeper((long) n * REPEAT);
+			timestart();
+			for (i = 0; i < n; i += BLOCKSIZE) {
+				m = n - i < BLOCKSIZE ? n - i : BLOCKSIZE;
+				trigger_block(values + i, m, values + i,
+					trigger, &status);
+			}
+			ttrigger += timeper((long) n * REPEAT);
+		}
+		diff_end(diff, &status);
+		amplify_end(amplify, &status);
+		trigger_end(trigger, &status);
+		printf("%s\t%.2f\t%.2f\t%.2f\n",
+			level == 0 ? "none" : level == 1 ? "sse2" : "avx2",
+			tdiff, tamplify, ttrigger);
+	}
+	filters_simd(-1);
+
+	free(values);
+}
+
+/*
+ * a capture of nec keys, with noise between them
+ */
+int necsamples(int *values, int duration, int level, unsigned int *seed) {
+	int i, n;
+	n = duration * 441 / 10000;
+	for (i = 0; i < n; i++)
+		values[i] = level + (int) (rand_r(seed) % 401) - 200;
+	return n;
+}
+
+int neccapture(int *values, int keys) {
+	unsigned int seed;
+	uint32_t code;
+	int k, b, n;
+
+	seed = 1;
+	n = necsamples(values, 500000, 0, &seed);
+	for (k = 0; k < keys; k++) {
+		code = 0x00FF00FF ^ (((k * 37) & 0xFF) << 8) ^
+			((k * 37) & 0xFF);
+		n += necsamples(values + n, 9000, 12000, &seed);
+		n += necsamples(values + n, 4500, 0, &seed);
+		for (b = 31; b >= 0; b--) {
+			n += necsamples(values + n, 562, 12000, &seed);
+			n += necsamples(values + n,
+				(code >> b) & 1 ? 1687 : 562, 0, &seed);
+		}
+		n += necsamples(values + n, 562, 12000, &seed);
+		n += necsamples(values + n, 40000 + rand_r(&seed) % 80000, 0,
+			&seed);
+	}
+	return n;
+}
+
+/*
+ * the protocols on runlength values
+ */
+#define NECKEYS 2000
+#define RANDOMRUNS 200000
+
+void benchprotocols() {
+	struct status status;
+	struct protocol_status interpreted[2 * MAXPROTOCOLS];
+	struct keyevent event;
+	void *filters, *protocols;
+	int *samples, *runs, nsamples, nruns, m, i, keys;
+	unsigned int seed;
+	long end;
+	double tinterpreted, tcompiled;
+
+	samples = malloc((NECKEYS + 4) * 10000 * sizeof(int));
+	nsamples = neccapture(samples, NECKEYS);
+
+	status.ended = 0;
+	status.flush = 0;
+	filters = fastbest_init(NULL, &status);
+	runs = samples;
+	nruns = 0;
+	for (i = 0; i < nsamples; i += BLOCKSIZE) {
+		m = nsamples - i < BLOCKSIZE ? nsamples - i : BLOCKSIZE;
+		memmove(runs + nruns, samples + i, m * sizeof(int));
+		nruns += fastbest_block(runs + nruns, m, runs + nruns,
+			filters, &status);
+	}
+	fastbest_end(filters, &status);
+
+	seed = 2;
+	for (i = 0; i < RANDOMRUNS; i++)
+		runs[nruns++] = (int) (rand_r(&seed) % 4001) - 2000;
+
+	for (m = 0; m < 2 * MAXPROTOCOLS; m++)
+		protocol_init(&interpreted[m]);
+	keys = 0;
+	timestart();
+	for (i = 0; i < nruns; i++)
+		keys += protocols_interpreted(runs[i], interpreted);
+	tinterpreted = timeper(nruns);
+	printf("protocols, %d runlength values, ns per value\n", nruns);
+	printf("interpreted\t%.1f\t%d keys\n", tinterpreted, keys);
+
+	protocols = protocols_init(0, NULL, 0);
+	keys = 0;
+	end = 0;
+	timestart();
+	for (i = 0; i < nruns; i++) {
+		end += abs(runs[i]);
+		keys += protocols_event(runs[i], end - 1, protocols, &event);
+	}
+	tcompiled = timeper(nruns);
+	protocols_end(protocols);
+	printf("compiled\t%.1f\t%d keys\n", tcompiled, keys);
+
+	free(samples);
+}
+
+/*
+ * main
+ */
+int main() {
+	struct windowfilter filters[] = {
+		{ "maximal", scanmaximal,
+		  maximal_init, maximal_block, maximal_end },
+		{ "boost", scanboost,
+		  boost_init, boost_block, boost_end },
+		{ "valley", scanvalley,
+		  valley_init, valley_block, valley_end },
+	};
+	int *input, f;
+
+	input = malloc(NVALUES * sizeof(int));
+	capture(input, NVALUES);
+
+	for (f = 0; f < (int) (sizeof(filters) / sizeof(filters[0])); f++) {
+		benchwindow(&filters[f], input, NVALUES / 8);
+		printf("\n");
+	}
+	benchsimd(input, NVALUES);
+	printf("\n");
+	benchprotocols();
+
+	free(input);
+	return EXIT_SUCCESS;
+}
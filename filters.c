@@ -28,16 +28,30 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
 #include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD
+#endif
 #include "filters.h"
 
 /*
- * an audio file, either AU or ascii
+ * an audio file, either AU or ascii; the input data is only used for reading
  */
 struct audiofile {
 	FILE *fd;
 	int ascii;
 	int channels;
+	unsigned char *data;
+	size_t pos;
+	size_t len;
+	int mapped;
+	int eof;
 };
 
 /*
@@ -55,7 +69,7 @@ struct buffer *balloc(int size) {
 	b = malloc(sizeof(struct buffer));
 	b->size = size;
 	b->data = malloc(b->size * sizeof(int));
-	memset(b->data, 0, b->size);
+	memset(b->data, 0, b->size * sizeof(int));
 	b->pos = 0;
 	return b;
 }
@@ -89,12 +103,379 @@ int maximal(struct buffer *b) {
 	return max;
 }
 
+/*
+ * maximum in absolute value of the last size values
+ *
+ * a deque of the values that may still become the maximum: those that are
+ * greater in absolute value than all values after them; it is decreasing, so
+ * the maximum is the first; each value enters and leaves the deque once, so
+ * the cost is constant on average regardless of size; initially, the window
+ * contains size zeros, like a buffer from balloc()
+ */
+struct window {
+	int size;
+	unsigned int time;
+	int *value;
+	unsigned int *index;
+	int first;
+	int num;
+};
+
+void wpush(struct window *w, int value);
+
+/*
+ * initialize a window on arrays of size + 1 elements
+ */
+void winit(struct window *w, int size, int *value, unsigned int *index) {
+	int i;
+	w->size = size;
+	w->time = 0;
+	w->value = value;
+	w->index = index;
+	w->first = 0;
+	w->num = 0;
+	for (i = 0; i < size; i++)
+		wpush(w, 0);
+}
+
+struct window *walloc(int size) {
+	struct window *w;
+	w = malloc(sizeof(struct window));
+	winit(w, size,
+		malloc((size + 1) * sizeof(int)),
+		malloc((size + 1) * sizeof(unsigned int)));
+	return w;
+}
+
+void wfree(struct window *w) {
+	free(w->value);
+	free(w->index);
+	free(w);
+}
+
+/*
+ * add a value to the window, dropping the oldest
+ */
+void wpush(struct window *w, int value) {
+	int last;
+
+	if (w->size == 0)
+		return;
+	value = abs(value);
+
+	last = w->first + w->num;
+	if (last > w->size)
+		last -= w->size + 1;
+	while (w->num > 0) {
+		last = last == 0 ? w->size : last - 1;
+		if (w->value[last] > value) {
+			last = last == w->size ? 0 : last + 1;
+			break;
+		}
+		w->num--;
+	}
+	w->value[last] = value;
+	w->index[last] = w->time;
+	w->num++;
+
+	if (w->time - w->index[w->first] >= (unsigned int) w->size) {
+		w->first = w->first == w->size ? 0 : w->first + 1;
+		w->num--;
+	}
+	w->time++;
+}
+
+/*
+ * maximum of the window in absolute value
+ */
+int wmax(struct window *w) {
+	return w->num == 0 ? 0 : w->value[w->first];
+}
+
+/*
+ * raise the value of the given index to a new maximum
+ */
+void wraise(struct window *w, unsigned int index, int value) {
+	if (w->num > 0 && w->index[w->first] == index) {
+		w->value[w->first] = abs(value);
+		return;
+	}
+	w->first = w->first == 0 ? w->size : w->first - 1;
+	w->value[w->first] = abs(value);
+	w->index[w->first] = index;
+	w->num++;
+}
+
+/*
+ * vector kernels for the filters that work on each value alone or on each
+ * value and the previous; the version for the processor is chosen when the
+ * program starts; each kernel processes as many values as fit in its vectors
+ * and returns how many, leaving the rest to the loop of the filter; stabilize
+ * has no kernel since its bound depends on all previous values
+ */
+#ifdef SIMD
+int simdlevel() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? 2 :
+		__builtin_cpu_supports("sse2") ? 1 : 0;
+}
+
+/*
+ * diff: the previous values are the current ones shifted by one, with the
+ * last of the previous vector first; this allows out to overlap in
+ */
+__attribute__((target("sse2")))
+int diff_sse2(int *in, int n, int *out, int *last) {
+	__m128i cur, prev, carry;
+	int i;
+	carry = _mm_cvtsi32_si128(*last);
+	for (i = 0; i + 4 <= n; i += 4) {
+		cur = _mm_loadu_si128((__m128i *) (in + i));
+		prev = _mm_or_si128(_mm_slli_si128(cur, 4), carry);
+		carry = _mm_srli_si128(cur, 12);
+		_mm_storeu_si128((__m128i *) (out + i), _mm_sub_epi32(cur, prev));
+	}
+	*last = _mm_cvtsi128_si32(carry);
+	return i;
+}
+
+__attribute__((target("avx2")))
+int diff_avx2(int *in, int n, int *out, int *last) {
+	__m256i cur, prev, carry, rotate;
+	int i;
+	rotate = _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6);
+	carry = _mm256_set1_epi32(*last);
+	for (i = 0; i + 8 <= n; i += 8) {
+		cur = _mm256_loadu_si256((__m256i *) (in + i));
+		prev = _mm256_permutevar8x32_epi32(cur, rotate);
+		cur = _mm256_sub_epi32(cur, _mm256_blend_epi32(prev, carry, 1));
+		carry = prev;
+		_mm256_storeu_si256((__m256i *) (out + i), cur);
+	}
+	*last = _mm256_cvtsi256_si32(carry);
+	return i;
+}
+
+/*
+ * amplify: the same conversions to and from double of the plain loop
+ */
+__attribute__((target("sse2")))
+int amplify_sse2(int *in, int n, int *out, double factor) {
+	__m128i v, low, high;
+	__m128d f;
+	int i;
+	f = _mm_set1_pd(factor);
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm_loadu_si128((__m128i *) (in + i));
+		low = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(v), f));
+		high = _mm_cvttpd_epi32(_mm_mul_pd(
+			_mm_cvtepi32_pd(_mm_srli_si128(v, 8)), f));
+		_mm_storeu_si128((__m128i *) (out + i),
+			_mm_unpacklo_epi64(low, high));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+int amplify_avx2(int *in, int n, int *out, double factor) {
+	__m128i v;
+	__m256d f;
+	int i;
+	f = _mm256_set1_pd(factor);
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm_loadu_si128((__m128i *) (in + i));
+		v = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(v), f));
+		_mm_storeu_si128((__m128i *) (out + i), v);
+	}
+	return i;
+}
+
+/*
+ * trigger: zero the values that are less than bound in absolute value
+ */
+__attribute__((target("sse2")))
+int trigger_sse2(int *in, int n, int *out, int bound) {
+	__m128i v, sign, mask, b;
+	int i;
+	b = _mm_set1_epi32(bound);
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm_loadu_si128((__m128i *) (in + i));
+		sign = _mm_srai_epi32(v, 31);
+		mask = _mm_sub_epi32(_mm_xor_si128(v, sign), sign);
+		mask = _mm_cmplt_epi32(mask, b);
+		_mm_storeu_si128((__m128i *) (out + i), _mm_andnot_si128(mask, v));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+int trigger_avx2(int *in, int n, int *out, int bound) {
+	__m256i v, mask, b;
+	int i;
+	b = _mm256_set1_epi32(bound);
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm256_loadu_si256((__m256i *) (in + i));
+		mask = _mm256_cmpgt_epi32(b, _mm256_abs_epi32(v));
+		_mm256_storeu_si256((__m256i *) (out + i),
+			_mm256_andnot_si256(mask, v));
+	}
+	return i;
+}
+#endif
+
+/*
+ * the kernels in use; without vectors, they process no value
+ */
+int nodiff(int *in, int n, int *out, int *last) {
+	(void) in;
+	(void) n;
+	(void) out;
+	(void) last;
+	return 0;
+}
+
+int noamplify(int *in, int n, int *out, double factor) {
+	(void) in;
+	(void) n;
+	(void) out;
+	(void) factor;
+	return 0;
+}
+
+int notrigger(int *in, int n, int *out, int bound) {
+	(void) in;
+	(void) n;
+	(void) out;
+	(void) bound;
+	return 0;
+}
+
+int (*diff_kernel)(int *in, int n, int *out, int *last) = nodiff;
+int (*amplify_kernel)(int *in, int n, int *out, double factor) = noamplify;
+int (*trigger_kernel)(int *in, int n, int *out, int bound) = notrigger;
+
+int filters_simd(int level) {
+#ifdef SIMD
+	if (level < 0 || level > simdlevel())
+		level = simdlevel();
+	diff_kernel = level == 2 ? diff_avx2 : level == 1 ? diff_sse2 : nodiff;
+	amplify_kernel = level == 2 ? amplify_avx2 :
+		level == 1 ? amplify_sse2 : noamplify;
+	trigger_kernel = level == 2 ? trigger_avx2 :
+		level == 1 ? trigger_sse2 : notrigger;
+	return level;
+#else
+	(void) level;
+	return 0;
+#endif
+}
+
+/*
+ * the kernels are chosen once, when the program starts
+ */
+#ifdef SIMD
+__attribute__((constructor))
+void simdinit() {
+	filters_simd(-1);
+}
+#endif
+
 /*
  * readinput filter
+ *
+ * regular files are memory-mapped, other inputs (pipes, stdin) are read in
+ * large chunks into a buffer; either way, the input bytes not yet used are
+ * data[pos] to data[len - 1], and are converted to values a block at a time
+ */
+#define READBUFFER (64 * 1024)
+
+/*
+ * make at least need bytes available if possible, keeping the ones not yet
+ * used; return the number of bytes available
+ */
+size_t audiofill(struct audiofile *file, size_t need) {
+	ssize_t res;
+
+	if (file->mapped || file->eof || file->len - file->pos >= need)
+		return file->len - file->pos;
+
+	memmove(file->data, file->data + file->pos, file->len - file->pos);
+	file->len -= file->pos;
+	file->pos = 0;
+
+	while (file->len < need && file->len < READBUFFER) {
+		res = read(fileno(file->fd),
+			file->data + file->len, READBUFFER - file->len);
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res <= 0) {
+			file->eof = 1;
+			break;
+		}
+		file->len += res;
+	}
+	return file->len;
+}
+
+/*
+ * skip some bytes of input
+ */
+void audioskip(struct audiofile *file, size_t skip) {
+	size_t len;
+	while (skip > 0 && audiofill(file, 1) > 0) {
+		len = file->len - file->pos;
+		len = len < skip ? len : skip;
+		file->pos += len;
+		skip -= len;
+	}
+}
+
+/*
+ * parse an integer in ascii, like fscanf("%d"); return 0 if there is none
  */
+int audioscan(struct audiofile *file, int *value) {
+	unsigned char *data;
+	size_t start, end;
+	int negative, digits;
+
+	while (1) {
+		data = file->data;
+		for (start = file->pos;
+		     start < file->len && isspace(data[start]);
+		     start++)
+			;
+		end = start;
+		if (end < file->len && (data[end] == '-' || data[end] == '+'))
+			end++;
+		while (end < file->len && isdigit(data[end]))
+			end++;
+
+		/* the number may continue after the data read so far */
+		if (end < file->len || file->mapped || file->eof ||
+		    end - file->pos >= READBUFFER)
+			break;
+		file->pos = start;
+		audiofill(file, file->len - file->pos + 1);
+	}
+
+	negative = start < end && data[start] == '-';
+	if (start < end && (data[start] == '-' || data[start] == '+'))
+		start++;
+	*value = 0;
+	for (digits = 0; start < end; start++, digits++)
+		*value = *value * 10 + (data[start] - '0');
+	if (negative)
+		*value = -*value;
+
+	file->pos = end;
+	return digits > 0;
+}
+
 void *read_init(char *filename, int ascii, struct status *status) {
 	struct audiofile *read;
+	struct stat st;
 	uint32_t header[6];
+	void *map;
 	int i;
 
 	read = malloc(sizeof(struct audiofile));
@@ -106,23 +487,48 @@ void *read_init(char *filename, int ascii, struct status *status) {
 		read->fd = fopen(filename, "r");
 		if (read->fd == NULL) {
 			perror(filename);
-			return 0;
+			free(read);
+			return NULL;
+		}
+	}
+
+	read->mapped = 0;
+	read->eof = 0;
+	read->pos = 0;
+	read->len = 0;
+	if (fstat(fileno(read->fd), &st) == 0 &&
+	    S_ISREG(st.st_mode) && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+			fileno(read->fd), 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			read->data = map;
+			read->len = st.st_size;
+			read->mapped = 1;
 		}
 	}
+	if (! read->mapped)
+		read->data = malloc(READBUFFER);
 
 	if (! ascii) {
-		fread(header, 4, 6, read->fd);
+		memset(header, 0, sizeof(header));
+		i = audiofill(read, 24) < 24 ? read->len - read->pos : 24;
+		memcpy(header, read->data + read->pos, i);
+		read->pos += i;
 
 		for (i = 0; i < 6; i++)
 			header[i] = be32toh(header[i]);
 
 		if (header[0] != 0x2E736E64) {
-			printf("%s: not an AU file\n", filename);
-			exit(EXIT_FAILURE);
+			fprintf(stderr, "%s: not an AU file\n", filename);
+			read_end(read, status);
+			return NULL;
 		}
 		if (header[3] != 3) {
-			printf("%s: not 16-bit linear PCM\n", filename);
-			exit(EXIT_FAILURE);
+			fprintf(stderr, "%s: not 16-bit linear PCM\n",
+				filename);
+			read_end(read, status);
+			return NULL;
 		}
 		if (header[4] != 44100)
 			fprintf(stderr, "WARNING: sample rate is not 44100\n");
@@ -131,7 +537,8 @@ void *read_init(char *filename, int ascii, struct status *status) {
 				"WARNING: using channel 1 of %d\n", header[5]);
 
 		read->channels = header[5];
-		fseek(read->fd, header[1], SEEK_SET);
+		if (header[1] > 24)
+			audioskip(read, header[1] - 24);
 	}
 
 	status->ended = 0;
@@ -139,37 +546,91 @@ void *read_init(char *filename, int ascii, struct status *status) {
 }
 
 int read_value(int value, void *internal, struct status *status) {
-	struct audiofile *read;
 	int out;
-	int16_t v, n;
-	int i, channel = 0;
 
 	(void) value;
+
+	if (read_block(NULL, 1, &out, internal, status) == 1)
+		return out;
+
+	status->ended = 1;
+	return 0;
+}
+
+int read_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	struct audiofile *read;
+	unsigned char *p;
+	int i, c, len, frame, channel = 0;
+
+	(void) in;
 	read = (struct audiofile *) internal;
 
 	if (read->ascii) {
-		if (1 == fscanf(read->fd, "%d", &out))
-			return out;
-	}
-	else {
-		for (i = 0; i < read->channels; i++) {
-			if (1 != fread(&n, 2, 1, read->fd))
+		for (i = 0; i < n; i++)
+			if (! audioscan(read, &out[i])) {
+				status->ended = 1;
 				break;
-			if (i == channel)
-				v = be16toh(n);
+			}
+		return i;
+	}
+
+	frame = 2 * read->channels;
+	for (i = 0; i < n; i += len) {
+		len = audiofill(read, frame) / frame;
+		if (len == 0) {
+			status->ended = 1;
+			break;
 		}
-		if (i == read->channels)
-			return v;
+		len = len < n - i ? len : n - i;
+		p = read->data + read->pos + 2 * channel;
+		for (c = 0; c < len; c++, p += frame)
+			out[i + c] = (int16_t) (p[0] << 8 | p[1]);
+		read->pos += len * frame;
 	}
+	return i;
+}
 
-	status->ended = 1;
-	return 0;
+/*
+ * skip values of input; return how many are skipped
+ */
+long read_skip(void *internal, long n, struct status *status) {
+	struct audiofile *read;
+	long i, len;
+	int value, frame;
+
+	read = (struct audiofile *) internal;
+
+	if (read->ascii) {
+		for (i = 0; i < n; i++)
+			if (! audioscan(read, &value)) {
+				status->ended = 1;
+				break;
+			}
+		return i;
+	}
+
+	frame = 2 * read->channels;
+	for (i = 0; i < n; i += len) {
+		len = audiofill(read, frame) / frame;
+		if (len == 0) {
+			status->ended = 1;
+			break;
+		}
+		len = len < n - i ? len : n - i;
+		read->pos += len * frame;
+	}
+	return i;
 }
 
 int read_end(void *internal, struct status *status) {
 	struct audiofile *read;
 	(void) status;
 	read = (struct audiofile *) internal;
+	if (read->mapped)
+		munmap(read->data, read->len);
+	else
+		free(read->data);
 	fclose(read->fd);
 	free(read);
 	return 0;
@@ -224,6 +685,33 @@ int log_value(int value, void *internal, struct status *status) {
 	return value;
 }
 
+int log_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	struct audiofile *log;
+	int16_t val[1024];
+	int i, c, len;
+
+	(void) status;
+
+	if (internal != NULL) {
+		log = (struct audiofile *) internal;
+		if (log->ascii)
+			for (i = 0; i < n; i++)
+				fprintf(log->fd, "%d\n", in[i]);
+		else
+			for (i = 0; i < n; i += len) {
+				len = n - i < 1024 ? n - i : 1024;
+				for (c = 0; c < len; c++)
+					val[c] = htobe16(in[i + c]);
+				fwrite(val, 2, len, log->fd);
+			}
+	}
+
+	if (out != in)
+		memmove(out, in, n * sizeof(int));
+	return n;
+}
+
 int log_end(void *internal, struct status *status) {
 	struct audiofile *log;
 	uint32_t size;
@@ -295,6 +783,14 @@ int scale_value(int value, void *internal, struct status *status) {
 	return value;
 }
 
+int scale_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	int i;
+	for (i = 0; i < n; i++)
+		out[i] = scale_value(in[i], internal, status);
+	return n;
+}
+
 int scale_end(void *internal, struct status *status) {
 	(void) status;
 	free(internal);
@@ -319,6 +815,17 @@ int amplify_value(int value, void *internal, struct status *status) {
 	return value * factor;
 }
 
+int amplify_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	double factor;
+	int i;
+	(void) status;
+	factor = * (double *) internal;
+	for (i = amplify_kernel(in, n, out, factor); i < n; i++)
+		out[i] = in[i] * factor;
+	return n;
+}
+
 int amplify_end(void *internal, struct status *status) {
 	free(internal);
 	status->hasout = 0;
@@ -350,6 +857,33 @@ int diff_value(int value, void *internal, struct status *status) {
 	return out;
 }
 
+int diff_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	int **prev, last, value;
+	int i, o, k;
+	(void) status;
+	prev = (int **) internal;
+	if (n == 0)
+		return 0;
+	i = 0;
+	o = 0;
+	if (*prev == NULL) {
+		*prev = malloc(sizeof(int));
+		**prev = in[i++];
+	}
+	last = **prev;
+	k = diff_kernel(in + i, n - i, out + o, &last);
+	i += k;
+	o += k;
+	for (; i < n; i++) {
+		value = in[i];
+		out[o++] = value - last;
+		last = value;
+	}
+	**prev = last;
+	return o;
+}
+
 int diff_end(void *internal, struct status *status) {
 	int **prev;
 	prev = (int **) internal;
@@ -413,6 +947,20 @@ int stabilize_value(int value, void *internal, struct status *status) {
 	return abs(value) < *bound / 4 ? 0 : value;
 }
 
+int stabilize_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	int bound, value, i;
+	(void) status;
+	bound = * (int *) internal;
+	for (i = 0; i < n; i++) {
+		value = in[i];
+		bound = bound < abs(value) ? abs(value) : bound * 9995 / 10000;
+		out[i] = abs(value) < bound / 4 ? 0 : value;
+	}
+	* (int *) internal = bound;
+	return n;
+}
+
 int stabilize_end(void *internal, struct status *status) {
 	free(internal);
 	status->hasout = 0;
@@ -422,29 +970,70 @@ int stabilize_end(void *internal, struct status *status) {
 /*
  * maximal filter
  */
+struct slidingmax {
+	struct buffer *buffer;
+	struct window *window;
+	struct window *before;
+};
+
+void *slidingmax_init(int size, int before) {
+	struct slidingmax *s;
+	s = malloc(sizeof(struct slidingmax));
+	s->buffer = balloc(size);
+	s->window = walloc(before ? size - size / 2 : size);
+	s->before = before ? walloc(size / 2) : NULL;
+	return s;
+}
+
+void slidingmax_end(void *internal) {
+	struct slidingmax *s;
+	s = (struct slidingmax *) internal;
+	bfree(s->buffer);
+	wfree(s->window);
+	if (s->before)
+		wfree(s->before);
+	free(s);
+}
+
 void *maximal_init(int size, struct status *status) {
 	(void) status;
-	return balloc(size);
+	return slidingmax_init(size, 0);
 }
 
 int maximal_value(int value, void *internal, struct status *status) {
+	struct slidingmax *s;
 	struct buffer *b;
-	int out;
+	int out, center;
 	(void) status;
-	b = (struct buffer *) internal;
+	s = (struct slidingmax *) internal;
+	b = s->buffer;
 	b->data[b->pos] = value;
 	b->pos = (b->pos + 1) % b->size;
-	if (abs(b->data[(b->pos + b->size / 2) % b->size]) != maximal(b))
+	wpush(s->window, value);
+	center = (b->pos + b->size / 2) % b->size;
+	if (abs(b->data[center]) != wmax(s->window))
 		out = 0;
 	else {
-		out = b->data[(b->pos + b->size / 2) % b->size];
-		b->data[(b->pos + b->size / 2) % b->size] *= 2;
+		out = b->data[center];
+		b->data[center] *= 2;
+		if (out != 0)
+			wraise(s->window,
+				s->window->time - b->size + b->size / 2,
+				b->data[center]);
 	}
 	return out;
 }
 
+int maximal_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	int i;
+	for (i = 0; i < n; i++)
+		out[i] = maximal_value(in[i], internal, status);
+	return n;
+}
+
 int maximal_end(void *internal, struct status *status) {
-	bfree(internal);
+	slidingmax_end(internal);
 	status->hasout = 0;
 	return 0;
 }
@@ -467,6 +1056,16 @@ int trigger_value(int value, void *internal, struct status *status) {
 	return abs(value) < *bound ? 0 : value;
 }
 
+int trigger_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	int bound, i;
+	(void) status;
+	bound = * (int *) internal;
+	for (i = trigger_kernel(in, n, out, bound); i < n; i++)
+		out[i] = abs(in[i]) < bound ? 0 : in[i];
+	return n;
+}
+
 int trigger_end(void *internal, struct status *status) {
 	free(internal);
 	status->hasout = 0;
@@ -530,6 +1129,30 @@ int background_value(int value, void *internal, struct status *status) {
 			0 : value;
 }
 
+int background_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	struct background *background;
+	int i, o, value, low, high;
+
+	background = (struct background *) internal;
+
+	/* learning the bounds: go value by value */
+	for (i = 0, o = 0; i < n && background->time <= 1000; i++) {
+		status->hasout = 1;
+		value = background_value(in[i], internal, status);
+		if (status->hasout)
+			out[o++] = value;
+	}
+
+	low = 2 * background->maxneg;
+	high = 2 * background->maxpos;
+	for (; i < n; i++) {
+		value = in[i];
+		out[o++] = low < value && value < high ? 0 : value;
+	}
+	return o;
+}
+
 int background_end(void *internal, struct status *status) {
 	free(internal);
 	status->hasout = 0;
@@ -550,6 +1173,16 @@ int positive_value(int value, void *internal, struct status *status) {
 	return abs(value);
 }
 
+int positive_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	int i;
+	(void) internal;
+	(void) status;
+	for (i = 0; i < n; i++)
+		out[i] = abs(in[i]);
+	return n;
+}
+
 int positive_end(void *internal, struct status *status) {
 	(void) internal;
 	status->hasout = 0;
@@ -561,20 +1194,27 @@ int positive_end(void *internal, struct status *status) {
  */
 void *boost_init(int size, struct status *status) {
 	(void) status;
-	return balloc(size);
+	return slidingmax_init(size, 0);
 }
 
 int boost_value(int value, void *internal, struct status *status) {
-	struct buffer *b;
+	struct slidingmax *s;
 	(void) status;
-	b = (struct buffer *) internal;
-	b->data[b->pos] = value;
-	b->pos = (b->pos + 1) % b->size;
-	return maximal(b);
+	s = (struct slidingmax *) internal;
+	wpush(s->window, value);
+	return wmax(s->window);
+}
+
+int boost_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	int i;
+	for (i = 0; i < n; i++)
+		out[i] = boost_value(in[i], internal, status);
+	return n;
 }
 
 int boost_end(void *internal, struct status *status) {
-	bfree(internal);
+	slidingmax_end(internal);
 	status->hasout = 0;
 	return 0;
 }
@@ -584,34 +1224,42 @@ int boost_end(void *internal, struct status *status) {
  */
 void *valley_init(int size, struct status *status) {
 	(void) status;
-	return balloc(size);
+	return slidingmax_init(size, 1);
 }
 
 int valley_value(int value, void *internal, struct status *status) {
-	int before, after, i, c;
+	int before, after;
+	struct slidingmax *s;
 	struct buffer *b;
 
 	(void) status;
 
-	b = (struct buffer *) internal;
+	s = (struct slidingmax *) internal;
+	b = s->buffer;
 	b->data[b->pos] = value;
 	b->pos = (b->pos + 1) % b->size;
 
-	before = 0;
-	after = 0;
-	for (i = 0; i < b->size; i++) {
-		c = abs(b->data[(b->pos + i) % b->size]);
-		if (i < b->size / 2 && before < c)
-			before = c;
-		if (i >= b->size / 2 && after < c)
-			after = c;
-	}
+	/* the new value enters the second half, and the one that was its
+	 * oldest passes to the first half */
+	wpush(s->window, value);
+	wpush(s->before,
+		b->data[(b->pos + b->size / 2 - 1 + b->size) % b->size]);
 
+	before = wmax(s->before);
+	after = wmax(s->window);
 	return before < after ? before : after;
 }
 
+int valley_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	int i;
+	for (i = 0; i < n; i++)
+		out[i] = valley_value(in[i], internal, status);
+	return n;
+}
+
 int valley_end(void *internal, struct status *status) {
-	bfree(internal);
+	slidingmax_end(internal);
 	status->hasout = 0;
 	return 0;
 }
@@ -643,6 +1291,26 @@ int runlength_value(int value, void *internal, struct status *status) {
 	return out;
 }
 
+int runlength_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	int time, value, i, o;
+
+	time = * (int *) internal;
+	for (i = 0, o = 0; i < n; i++) {
+		value = in[i];
+		if (value != 0 || abs(time) > 10000) {
+			out[o++] = time;
+			time = value < 0 ? -1 : value > 0 ? 1 :
+				time < 0 ? -1 : 1;
+			status->flush = 1;
+		}
+		else
+			time = time < 0 ? time - 1 : time + 1;
+	}
+	* (int *) internal = time;
+	return o;
+}
+
 int runlength_end(void *internal, struct status *status) {
 	int time;
 	(void) status;
@@ -677,6 +1345,25 @@ int collapse_value(int value, void *internal, struct status *status) {
 	}
 }
 
+int collapse_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	int prev, value, i, o;
+
+	prev = * (int *) internal;
+	for (i = 0, o = 0; i < n; i++) {
+		value = in[i];
+		if ((prev < 0 && value < 0) || (prev > 0 && value > 0))
+			prev += value;
+		else {
+			out[o++] = prev;
+			prev = value;
+			status->flush = 1;
+		}
+	}
+	* (int *) internal = prev;
+	return o;
+}
+
 int collapse_end(void *internal, struct status *status) {
 	int prev;
 	(void) status;
@@ -728,6 +1415,22 @@ int best_value(int value, void *internal, struct status *status) {
 	return value;
 }
 
+int best_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	int i, o, value;
+
+	/* best_value() passes each value through all filters, even if one
+	 * of them has no output for it; the output is only the values that
+	 * all filters have output */
+	for (i = 0, o = 0; i < n; i++) {
+		status->hasout = 1;
+		value = best_value(in[i], internal, status);
+		if (status->hasout)
+			out[o++] = value;
+	}
+	return o;
+}
+
 int best_end(void *internal, struct status *status) {
 	struct bestfilters *bestfilters;
 	int value;
@@ -745,6 +1448,144 @@ int best_end(void *internal, struct status *status) {
 	return value;
 }
 
+/*
+ * the best sequence of filters in a single loop, with the state of all of
+ * them in the same struct; the output is the same as best
+ */
+#define FASTBEST_SIZE 11
+struct fastbest {
+	void *log;
+	int started;
+	int prev;
+	int pos;
+	int bound;
+	int time;
+	struct background background;
+	int buffer[FASTBEST_SIZE];
+	int magnitude[2 * FASTBEST_SIZE];
+};
+
+void *fastbest_init(char *logfile, struct status *status) {
+	struct fastbest *fastbest;
+
+	fastbest = malloc(sizeof(struct fastbest));
+	fastbest->log = log_init(logfile, 0, status);
+	fastbest->started = 0;
+	fastbest->prev = 0;
+	fastbest->pos = 0;
+	memset(fastbest->buffer, 0, sizeof(fastbest->buffer));
+	memset(fastbest->magnitude, 0, sizeof(fastbest->magnitude));
+	fastbest->bound = 0;
+	fastbest->background.time = 0;
+	fastbest->background.silencetime = 0;
+	fastbest->background.maxpos = -1;
+	fastbest->background.maxneg = 1;
+	fastbest->time = -1;
+
+	return fastbest;
+}
+
+/*
+ * the window of maximal is small: rather than a deque, the absolute values
+ * are stored twice in magnitude[], so that the last FASTBEST_SIZE of them
+ * are contiguous and their maximum is found by a loop without branches
+ */
+int fastbest_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	struct fastbest *f;
+	struct status learn;
+	int i, o, j, value, hasout, center, max, *window, low, high;
+
+	f = (struct fastbest *) internal;
+
+	log_block(in, n, in, f->log, status);
+
+	low = 2 * f->background.maxneg;
+	high = 2 * f->background.maxpos;
+	for (i = 0, o = 0; i < n; i++) {
+		value = in[i];
+
+		/* diff; the first value has no output, but it is still passed
+		 * as zero to the other filters, like best_value() does */
+		hasout = f->started;
+		value = f->started ? value - f->prev : 0;
+		f->prev = in[i];
+		f->started = 1;
+
+		/* maximal */
+		f->buffer[f->pos] = value;
+		f->magnitude[f->pos] = abs(value);
+		f->magnitude[f->pos + FASTBEST_SIZE] = abs(value);
+		f->pos = f->pos == FASTBEST_SIZE - 1 ? 0 : f->pos + 1;
+		window = f->magnitude + f->pos;
+		max = window[0];
+		for (j = 1; j < FASTBEST_SIZE; j++)
+			max = max < window[j] ? window[j] : max;
+		center = f->pos + FASTBEST_SIZE / 2;
+		if (center >= FASTBEST_SIZE)
+			center -= FASTBEST_SIZE;
+		if (abs(f->buffer[center]) != max)
+			value = 0;
+		else {
+			value = f->buffer[center];
+			f->buffer[center] *= 2;
+			f->magnitude[center] = abs(f->buffer[center]);
+			f->magnitude[center + FASTBEST_SIZE] =
+				abs(f->buffer[center]);
+		}
+
+		/* stabilize */
+		f->bound = f->bound < abs(value) ?
+			abs(value) : f->bound * 9995 / 10000;
+		value = abs(value) < f->bound / 4 ? 0 : value;
+
+		/* background */
+		if (f->background.time <= 1000) {
+			learn.hasout = 1;
+			value = background_value(value, &f->background, &learn);
+			hasout = hasout && learn.hasout;
+			low = 2 * f->background.maxneg;
+			high = 2 * f->background.maxpos;
+		}
+		else if (low < value && value < high)
+			value = 0;
+
+		/* runlength */
+		if (value != 0 || abs(f->time) > 10000) {
+			if (hasout)
+				out[o++] = f->time;
+			f->time = value < 0 ? -1 : value > 0 ? 1 :
+				f->time < 0 ? -1 : 1;
+		}
+		else
+			f->time = f->time < 0 ? f->time - 1 : f->time + 1;
+	}
+
+	if (o > 0)
+		status->flush = 1;
+	return o;
+}
+
+int fastbest_value(int value, void *internal, struct status *status) {
+	int out = 0;
+	if (fastbest_block(&value, 1, &out, internal, status) == 0)
+		status->hasout = 0;
+	return out;
+}
+
+int fastbest_end(void *internal, struct status *status) {
+	struct fastbest *fastbest;
+	int value;
+
+	fastbest = (struct fastbest *) internal;
+
+	log_end(fastbest->log, status);
+	value = fastbest->time;
+
+	free(internal);
+	return value;
+}
+
 /*
  * apply a filter
  */
@@ -51,6 +51,7 @@ void *valley_init(int size, struct status *status);
 void *runlength_init(struct status *status);
 void *collapse_init(struct status *status);
 void *best_init(char *logfile, struct status *status);
+void *fastbest_init(char *logfile, struct status *status);
 
 int read_value(int value, void *internal, struct status *status);
 int log_value(int value, void *internal, struct status *status);
@@ -67,6 +68,46 @@ int valley_value(int value, void *internal, struct status *status);
 int runlength_value(int value, void *internal, struct status *status);
 int collapse_value(int value, void *internal, struct status *status);
 int best_value(int value, void *internal, struct status *status);
+int fastbest_value(int value, void *internal, struct status *status);
+
+/*
+ * block versions: process the n values in in[] at once and store the values
+ * that are output in out[], which may be the same array as in[]; return the
+ * number of values output; the sources (read, microphone) ignore in[] and
+ * output up to n values, setting status->ended at the end of the input
+ */
+int read_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int log_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int scale_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int diff_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int amplify_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int stabilize_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int maximal_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int trigger_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int background_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int positive_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int boost_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int valley_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int runlength_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int collapse_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int best_block(int *in, int n, int *out, void *internal,
+		struct status *status);
+int fastbest_block(int *in, int n, int *out, void *internal,
+		struct status *status);
 
 int read_end(void *internal, struct status *status);
 int log_end(void *internal, struct status *status);
@@ -83,6 +124,12 @@ int valley_end(void *internal, struct status *status);
 int runlength_end(void *internal, struct status *status);
 int collapse_end(void *internal, struct status *status);
 int best_end(void *internal, struct status *status);
+int fastbest_end(void *internal, struct status *status);
+
+/*
+ * skip input values without filtering them; return how many are skipped
+ */
+long read_skip(void *internal, long n, struct status *status);
 
 /*
  * apply a filter
@@ -96,4 +143,23 @@ int best_end(void *internal, struct status *status);
 	if (! (status)->hasout) continue;			\
 }
 
+/*
+ * apply a filter to a block of values, in place
+ */
+#define FILTER_BLOCK(filter, values, n, internal, status) {		\
+	n = filter ## _block (values, n, values, internal, status);	\
+}
+
+/*
+ * vector instructions used by the block filters: 0 none, 1 sse2, 2 avx2; the
+ * best the processor supports is chosen when the program starts; this allows
+ * using a lower level, for testing; return the level in use
+ */
+int filters_simd(int level);
+
+/*
+ * number of values in a block
+ */
+#define BLOCKSIZE 4096
+
 #endif
@@ -56,8 +56,14 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <termios.h>
-#include <pthread.h>
-#include <signal.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "microphone.h"
 #include "filters.h"
 #include "protocols.h"
@@ -76,20 +82,133 @@ int maxlen(char *a, char *b) {
 }
 
 /*
- * keyboard input thread
+ * sources of commands: the keyboard and the connections to the control
+ * socket, if any; each byte read from them is a command
  */
-void *keyboard(void *arg) {
-	char *command;
-	char c;
+#define MAXCONNECTIONS 8
+struct control {
+	int keyboard;
+	int socket;
+	char *path;
+	int connection[MAXCONNECTIONS];
+	int nconnections;
+};
 
-	command = (char *) arg;
+/*
+ * start reading commands from the keyboard and from the control socket at
+ * path, if not NULL
+ */
+int controlopen(struct control *control, char *path) {
+	struct sockaddr_un address;
+
+	control->keyboard = STDIN_FILENO;
+	control->socket = -1;
+	control->path = NULL;
+	control->nconnections = 0;
+	if (path == NULL)
+		return 0;
 
-	do {
-		read(STDIN_FILENO, &c, 1);
-		*command = c;
-	} while (c != 'q' && c != 'x');
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		printf("control socket name too long: %s\n", path);
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	control->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (control->socket == -1) {
+		perror("control socket");
+		return -1;
+	}
+	unlink(path);
+	if (bind(control->socket, (struct sockaddr *) &address,
+			sizeof(address)) ||
+	    listen(control->socket, MAXCONNECTIONS)) {
+		perror(path);
+		close(control->socket);
+		control->socket = -1;
+		return -1;
+	}
+	control->path = path;
+	return 0;
+}
+
+void controlclose(struct control *control) {
+	int i;
 
-	return NULL;
+	for (i = 0; i < control->nconnections; i++)
+		close(control->connection[i]);
+	if (control->socket != -1) {
+		close(control->socket);
+		unlink(control->path);
+	}
+}
+
+/*
+ * wait for a command or for samples from the microphone; return the command,
+ * or '\0' when the microphone is ready; without a microphone, the input is a
+ * file that never waits, and '\0' is returned at once if no command is there
+ *
+ * nothing runs while waiting: the samples are waited for on the descriptor of
+ * the microphone, the commands on the keyboard and the control connections
+ */
+char waitevent(struct control *control, void *microphone) {
+	struct pollfd fds[3 + MAXCONNECTIONS];
+	int nfds, i, j, fd;
+	char command;
+
+	while (1) {
+					/* drop closed connections */
+
+		for (i = 0, j = 0; i < control->nconnections; i++)
+			if (control->connection[i] != -1)
+				control->connection[j++] =
+					control->connection[i];
+		control->nconnections = j;
+
+		fds[0].fd = microphone ? microphone_fd(microphone) : -1;
+		fds[1].fd = control->keyboard;
+		fds[2].fd = control->socket;
+		for (i = 0; i < control->nconnections; i++)
+			fds[3 + i].fd = control->connection[i];
+		nfds = 3 + control->nconnections;
+		for (i = 0; i < nfds; i++)
+			fds[i].events = POLLIN;
+
+		if (poll(fds, nfds, microphone ? -1 : 0) <= 0)
+			return '\0';
+
+					/* commands: keyboard, then connections */
+
+		if (fds[1].revents) {
+			if (read(control->keyboard, &command, 1) == 1)
+				return command;
+			control->keyboard = -1;
+		}
+		for (i = 0; i < control->nconnections; i++) {
+			if (! fds[3 + i].revents)
+				continue;
+			if (read(control->connection[i], &command, 1) == 1)
+				return command;
+			close(control->connection[i]);
+			control->connection[i] = -1;
+		}
+
+					/* new connection */
+
+		if (fds[2].revents) {
+			fd = accept(control->socket, NULL, NULL);
+			if (fd != -1 && control->nconnections < MAXCONNECTIONS)
+				control->connection[control->nconnections++] =
+					fd;
+			else if (fd != -1)
+				close(fd);
+		}
+
+		if (fds[0].revents || microphone == NULL)
+			return '\0';
+	}
 }
 
 /*
@@ -161,13 +280,131 @@ void printnamedkey(struct namedkey *nk) {
 
 /*
  * layout of a remote
+ *
+ * the keys with a code and the names that are not fillers are indexed by a
+ * hash each: a bucket is the last position added to it, and the previous ones
+ * are chained through keynext and namenext
+ *
+ * a layout loaded from its cache has its names and keys in the memory map of
+ * the cache and its namedkeys in block; they are not freed one by one
+ *
+ * dirty tells whether a key was replaced since the layout was read or saved
  */
 struct layout {
 	struct namedkey **namedkey;
 	int num;
 	int size;
+	int *keybucket, *keynext;
+	int *namebucket, *namenext;
+	int buckets;
+	char *map;
+	size_t mapsize;
+	struct namedkey *block;
+	int dirty;
 };
 
+/*
+ * whether some memory is in the cache of a layout
+ */
+int layoutmapped(struct layout *layout, void *pointer) {
+	return layout->map != NULL &&
+		(char *) pointer >= layout->map &&
+		(char *) pointer < layout->map + layout->mapsize;
+}
+
+/*
+ * hash of a key, of the fields compared by keyequal()
+ */
+unsigned keyhash(struct key *key) {
+	unsigned hash;
+	hash = key->protocol;
+	hash = hash * 31 + key->device;
+	hash = hash * 31 + key->subdevice;
+	hash = hash * 31 + key->function;
+	hash = hash * 31 + key->subfunction;
+	return hash ^ (hash >> 16);
+}
+
+/*
+ * hash of a name
+ */
+unsigned namehash(char *name) {
+	unsigned hash;
+	for (hash = 5381; *name != '\0'; name++)
+		hash = hash * 33 + (unsigned char) *name;
+	return hash;
+}
+
+/*
+ * whether a name is a filler (spaces or newline)
+ */
+int isfiller(char *name) {
+	return name[0] == ' ' || name[0] == '\n';
+}
+
+/*
+ * add a position to the indexes, or remove it from the key index
+ */
+void layoutindexkey(struct layout *layout, int pos) {
+	struct key *key;
+	unsigned b;
+
+	key = layout->namedkey[pos]->key;
+	if (key == NULL)
+		return;
+	b = keyhash(key) & (layout->buckets - 1);
+	layout->keynext[pos] = layout->keybucket[b];
+	layout->keybucket[b] = pos;
+}
+
+void layoutindexname(struct layout *layout, int pos) {
+	char *name;
+	unsigned b;
+
+	name = layout->namedkey[pos]->name;
+	if (isfiller(name))
+		return;
+	b = namehash(name) & (layout->buckets - 1);
+	layout->namenext[pos] = layout->namebucket[b];
+	layout->namebucket[b] = pos;
+}
+
+void layoutunindexkey(struct layout *layout, int pos) {
+	struct key *key;
+	int *link;
+
+	key = layout->namedkey[pos]->key;
+	if (key == NULL)
+		return;
+	link = &layout->keybucket[keyhash(key) & (layout->buckets - 1)];
+	while (*link != -1 && *link != pos)
+		link = &layout->keynext[*link];
+	if (*link == pos)
+		*link = layout->keynext[pos];
+}
+
+/*
+ * rebuild the indexes with at least as many buckets as positions
+ */
+void layoutrehash(struct layout *layout) {
+	int pos, b;
+
+	while (layout->buckets < layout->num)
+		layout->buckets *= 2;
+	layout->keybucket = realloc(layout->keybucket,
+		layout->buckets * sizeof(int));
+	layout->namebucket = realloc(layout->namebucket,
+		layout->buckets * sizeof(int));
+	for (b = 0; b < layout->buckets; b++) {
+		layout->keybucket[b] = -1;
+		layout->namebucket[b] = -1;
+	}
+	for (pos = 0; pos < layout->num; pos++) {
+		layoutindexkey(layout, pos);
+		layoutindexname(layout, pos);
+	}
+}
+
 /*
  * initialize a layout
  */
@@ -177,6 +414,16 @@ struct layout *layoutnew() {
 	layout->namedkey = NULL;
 	layout->num = 0;
 	layout->size = 0;
+	layout->keybucket = NULL;
+	layout->keynext = NULL;
+	layout->namebucket = NULL;
+	layout->namenext = NULL;
+	layout->buckets = 16;
+	layout->map = NULL;
+	layout->mapsize = 0;
+	layout->block = NULL;
+	layout->dirty = 0;
+	layoutrehash(layout);
 	return layout;
 }
 
@@ -186,10 +433,19 @@ struct layout *layoutnew() {
 void layoutfree(struct layout *layout) {
 	int pos;
 	for (pos = 0; pos < layout->num; pos++) {
-		free(layout->namedkey[pos]->name);
-		free(layout->namedkey[pos]->key);
+		if (! layoutmapped(layout, layout->namedkey[pos]->name))
+			free(layout->namedkey[pos]->name);
+		if (! layoutmapped(layout, layout->namedkey[pos]->key))
+			free(layout->namedkey[pos]->key);
 	}
+	if (layout->map != NULL)
+		munmap(layout->map, layout->mapsize);
+	free(layout->block);
 	free(layout->namedkey);
+	free(layout->keybucket);
+	free(layout->keynext);
+	free(layout->namebucket);
+	free(layout->namenext);
 	free(layout);
 }
 
@@ -202,11 +458,34 @@ int layoutadd(struct layout *layout, struct namedkey *namedkey) {
 		layout->size += 10;
 		layout->namedkey = realloc(layout->namedkey,
 			layout->size * sizeof(struct namedkey *));
+		layout->keynext = realloc(layout->keynext,
+			layout->size * sizeof(int));
+		layout->namenext = realloc(layout->namenext,
+			layout->size * sizeof(int));
 	}
 	layout->namedkey[layout->num - 1] = namedkey;
+	if (layout->num > layout->buckets)
+		layoutrehash(layout);
+	else {
+		layoutindexkey(layout, layout->num - 1);
+		layoutindexname(layout, layout->num - 1);
+	}
 	return 0;
 }
 
+/*
+ * replace the code of a key in a layout
+ */
+void layoutreplace(struct layout *layout, int pos, struct key *key) {
+	layoutunindexkey(layout, pos);
+	if (layoutmapped(layout, layout->namedkey[pos]->key))
+		layout->namedkey[pos]->key = key;
+	else
+		namedkeyreplace(layout->namedkey[pos], key);
+	layoutindexkey(layout, pos);
+	layout->dirty = 1;
+}
+
 /*
  * read a layout from file
  */
@@ -271,67 +550,656 @@ int layoutwrite(FILE *fd, struct layout *layout) {
 		fprintf(fd, "%s", key);
 		free(key);
 	}
+	return ferror(fd) ? -1 : 0;
+}
+
+/*
+ * binary cache of a layout file
+ * -----------------------------
+ *
+ * the cache of dir/layout.txt is dir/.layout.txt.cache; it is valid if the
+ * size and modification time of the layout file are the ones in its header,
+ * and so is the hash of the names of the protocols, since the keys store
+ * their numbers; it is rebuilt otherwise; after the header:
+ * - the namedkeys, each an offset in the arena and a key if any
+ * - the arena, all names one after the other, each ended by '\0'
+ *
+ * the cache is mapped private, so that the keys can be replaced without
+ * changing it; the layout file is the only one ever written
+ */
+#define CACHEMAGIC 0x4C594143
+#define CACHEVERSION 2
+struct cacheheader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t protocols;
+	uint32_t unused;
+	int64_t size;
+	int64_t mtime;
+	int64_t mtimensec;
+	int32_t num;
+	int32_t keysize;
+	int64_t arena;
+};
+struct cachekey {
+	int32_t name;
+	int32_t haskey;
+	struct key key;
+};
+
+/*
+ * the name of a hidden file next to a layout file: dir/.layout.txt.suffix
+ */
+char *hiddenname(char *filename, char *suffix) {
+	char *slash, *name;
+	int dir;
+
+	slash = strrchr(filename, '/');
+	dir = slash == NULL ? 0 : slash - filename + 1;
+	name = malloc(strlen(filename) + strlen(suffix) + 3);
+	sprintf(name, "%.*s.%s.%s", dir, filename, filename + dir, suffix);
+	return name;
+}
+
+/*
+ * sync the directory of a file, so that a rename to the file is on disk
+ */
+int syncdir(char *filename) {
+	char *slash, *dir;
+	int fd, res;
+
+	slash = strrchr(filename, '/');
+	dir = slash == NULL ?
+		strdup(".") : strndup(filename, slash - filename + 1);
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	free(dir);
+	if (fd == -1)
+		return -1;
+	res = fsync(fd);
+	close(fd);
+	return res;
+}
+
+/*
+ * map the cache of a layout file, if valid
+ */
+struct layout *cacheread(char *filename, struct stat *source) {
+	char *name, *map, *arena;
+	struct cacheheader *header;
+	struct cachekey *entry;
+	struct layout *layout;
+	struct stat st;
+	size_t size;
+	int fd, pos;
+
+	name = hiddenname(filename, "cache");
+	fd = open(name, O_RDONLY);
+	free(name);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct cacheheader)) {
+		close(fd);
+		return NULL;
+	}
+	size = st.st_size;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	header = (struct cacheheader *) map;
+	entry = (struct cachekey *) (map + sizeof(struct cacheheader));
+	arena = (char *) (entry + header->num);
+	if (header->magic != CACHEMAGIC ||
+	    header->version != CACHEVERSION ||
+	    header->keysize != sizeof(struct key) ||
+	    header->protocols != protocols_hash() ||
+	    header->size != source->st_size ||
+	    header->mtime != source->st_mtim.tv_sec ||
+	    header->mtimensec != source->st_mtim.tv_nsec ||
+	    header->num < 0 || header->arena < 1 ||
+	    size != sizeof(struct cacheheader) +
+		header->num * sizeof(struct cachekey) + header->arena ||
+	    arena[header->arena - 1] != '\0') {
+		munmap(map, size);
+		return NULL;
+	}
+
+	layout = layoutnew();
+	layout->map = map;
+	layout->mapsize = size;
+	layout->block = malloc((header->num + 1) * sizeof(struct namedkey));
+	layout->size = header->num;
+	layout->namedkey = malloc((header->num + 1) *
+		sizeof(struct namedkey *));
+	layout->keynext = malloc((header->num + 1) * sizeof(int));
+	layout->namenext = malloc((header->num + 1) * sizeof(int));
+	for (pos = 0; pos < header->num; pos++) {
+		if (entry[pos].name < 0 || entry[pos].name >= header->arena) {
+			layoutfree(layout);
+			return NULL;
+		}
+		layout->block[pos].name = arena + entry[pos].name;
+		layout->block[pos].key =
+			entry[pos].haskey ? &entry[pos].key : NULL;
+		layout->namedkey[pos] = &layout->block[pos];
+	}
+	layout->num = header->num;
+	layoutrehash(layout);
+	return layout;
+}
+
+/*
+ * write the cache of a layout file; not an error if it cannot
+ */
+void cachewrite(char *filename, struct stat *source, struct layout *layout) {
+	char *name, *temp;
+	struct cacheheader header;
+	struct cachekey entry;
+	struct namedkey *nk;
+	FILE *fd;
+	int pos, res;
+
+	name = hiddenname(filename, "cache");
+	temp = malloc(strlen(name) + 5);
+	sprintf(temp, "%s.new", name);
+	fd = fopen(temp, "w");
+	if (fd == NULL) {
+		free(temp);
+		free(name);
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = CACHEMAGIC;
+	header.version = CACHEVERSION;
+	header.protocols = protocols_hash();
+	header.size = source->st_size;
+	header.mtime = source->st_mtim.tv_sec;
+	header.mtimensec = source->st_mtim.tv_nsec;
+	header.num = layout->num;
+	header.keysize = sizeof(struct key);
+	header.arena = 0;
+	for (pos = 0; pos < layout->num; pos++)
+		header.arena += strlen(layout->namedkey[pos]->name) + 1;
+	if (header.arena == 0)
+		header.arena = 1;
+	res = fwrite(&header, sizeof(header), 1, fd) != 1;
+
+	header.arena = 0;
+	for (pos = 0; pos < layout->num; pos++) {
+		nk = layout->namedkey[pos];
+		memset(&entry, 0, sizeof(entry));
+		entry.name = header.arena;
+		entry.haskey = nk->key != NULL;
+		if (nk->key != NULL)
+			entry.key = *nk->key;
+		res |= fwrite(&entry, sizeof(entry), 1, fd) != 1;
+		header.arena += strlen(nk->name) + 1;
+	}
+	for (pos = 0; pos < layout->num; pos++) {
+		nk = layout->namedkey[pos];
+		res |= fwrite(nk->name, strlen(nk->name) + 1, 1, fd) != 1;
+	}
+	if (layout->num == 0)
+		res |= fputc('\0', fd) == EOF;
+
+	res |= fclose(fd) != 0;
+	if (res || rename(temp, name))
+		unlink(temp);
+	else
+		syncdir(name);
+	free(temp);
+	free(name);
+}
+
+/*
+ * read a layout file through its cache, rebuilding the cache if stale
+ */
+struct layout *layoutload(char *filename, FILE *fd) {
+	struct layout *layout;
+	struct stat st;
+
+	if (fstat(fileno(fd), &st))
+		return layoutread(fd);
+	layout = cacheread(filename, &st);
+	if (layout != NULL)
+		return layout;
+	layout = layoutread(fd);
+	if (layout != NULL)
+		cachewrite(filename, &st, layout);
+	return layout;
+}
+
+/*
+ * save a layout to file: write it to a temporary file, sync it and rename it
+ * to the layout file, so that this is always either the old or the new
+ * layout, whole; the cache is updated as well; a symbolic link is followed,
+ * so that the file it points to is replaced and the link is kept
+ */
+int layoutsave(char *filename, struct layout *layout) {
+	char *real, *target, *temp;
+	struct stat st;
+	FILE *fd;
+	int res;
+
+	real = realpath(filename, NULL);
+	target = real != NULL ? real : filename;
+	temp = hiddenname(target, "new");
+	fd = fopen(temp, "w");
+	if (fd == NULL) {
+		perror(temp);
+		free(temp);
+		free(real);
+		return -1;
+	}
+	if (! stat(target, &st))
+		fchmod(fileno(fd), st.st_mode & 07777);
+	res = layoutwrite(fd, layout);
+	res |= fflush(fd);
+	res |= fsync(fileno(fd));
+	res |= fclose(fd);
+	if (res || rename(temp, target) || syncdir(target)) {
+		perror(filename);
+		unlink(temp);
+		free(temp);
+		free(real);
+		return -1;
+	}
+	free(temp);
+	free(real);
+
+	layout->dirty = 0;
+	if (! stat(filename, &st))
+		cachewrite(filename, &st, layout);
 	return 0;
 }
 
 /*
- * find position of a name and/or code in a layout
+ * find position of a name and/or code in a layout; the first one if many
  */
 int layoutfind(struct layout *layout, char *name, struct key *key) {
 	struct namedkey *nk;
-	int pos;
+	int pos, *next, found;
 
-	for (pos = 0; pos < layout->num; pos++) {
+	if (key != NULL) {
+		pos = layout->keybucket[keyhash(key) & (layout->buckets - 1)];
+		next = layout->keynext;
+	}
+	else if (name != NULL && ! isfiller(name)) {
+		pos = layout->namebucket[namehash(name) & (layout->buckets - 1)];
+		next = layout->namenext;
+	}
+	else {
+		for (pos = 0; pos < layout->num; pos++) {
+			nk = layout->namedkey[pos];
+			if (name == NULL || ! strcmp(name, nk->name))
+				return pos;
+		}
+		return -1;
+	}
+
+	found = -1;
+	for (; pos != -1; pos = next[pos]) {
 		nk = layout->namedkey[pos];
 		if (name != NULL && ! ! strcmp(name, nk->name))
 			continue;
 		if (key != NULL && ! keyequal(key, nk->key, 0))
 			continue;
-		return pos;
+		if (found == -1 || pos < found)
+			found = pos;
 	}
 
-	return -1;
+	return found;
 }
 
 /*
- * print the protocol(s) and device(s) of a remote
+ * journal of the keys assigned since the layout was last saved
+ * ------------------------------------------------------------
+ *
+ * each key assigned is appended to dir/.layout.txt.journal as a line
+ * "position name|code" and synced, which costs much less than saving the
+ * whole layout; the journal is replayed when the layout is read again, which
+ * recovers the keys if the program was terminated before saving, and is
+ * emptied when the layout is saved
  */
-void layoutremoteprint(struct layout *layout) {
-	struct layout *remote;
-	struct namedkey *k1, *k2;
-	int p1, p2;
-	int found;
-	char device[100];
+FILE *journalopen(char *filename) {
+	char *name;
+	FILE *journal;
+
+	name = hiddenname(filename, "journal");
+	journal = fopen(name, "a");
+	if (journal == NULL)
+		perror(name);
+	free(name);
+	return journal;
+}
+
+int journalappend(FILE *journal, struct layout *layout, int pos) {
+	char *key;
+	int res;
+
+	key = namedkeytostring(layout->namedkey[pos]);
+	fprintf(journal, "%d %s\n", pos, key);
+	free(key);
+	res = fflush(journal);
+	res |= fdatasync(fileno(journal));
+	return res;
+}
+
+/*
+ * replay the journal; a key whose position has a different name in the
+ * layout is assigned to the first key of its name, if any
+ */
+int journalreplay(char *filename, struct layout *layout) {
+	char *name, line[200], key[100];
+	struct namedkey *nk;
+	FILE *journal;
+	int pos, n;
 
-	remote = layoutnew();
+	name = hiddenname(filename, "journal");
+	journal = fopen(name, "r");
+	free(name);
+	if (journal == NULL)
+		return 0;
 
-	for (p1 = 0; p1 < layout->num; p1++) {
-		k1 = layout->namedkey[p1];
-		if (k1->key == NULL)
+	n = 0;
+	while (fgets(line, sizeof(line), journal)) {
+		if (sscanf(line, "%d %80s", &pos, key) != 2)
 			continue;
-		found = 0;
-		for (p2 = 0; p2 < remote->num; p2++) {
-			k2 = remote->namedkey[p2];
-			if (k1->key->protocol == k2->key->protocol &&
-			    k1->key->device == k2->key->device &&
-			    k1->key->subdevice == k2->key->subdevice) {
-				found = 1;
-				break;
-			}
+		nk = stringtonamedkey(key);
+		if (nk->key != NULL &&
+		    (pos < 0 || pos >= layout->num ||
+		     strcmp(nk->name, layout->namedkey[pos]->name)))
+			pos = layoutfind(layout, nk->name, NULL);
+		if (nk->key != NULL && pos != -1) {
+			layoutreplace(layout, pos, nk->key);
+			n++;
 		}
-		if (found)
+		else
+			free(nk->key);
+		free(nk->name);
+		free(nk);
+	}
+
+	fclose(journal);
+	return n;
+}
+
+/*
+ * empty the journal, once the layout is saved or discarded
+ */
+void journalclear(char *filename, FILE *journal) {
+	char *name;
+
+	if (journal != NULL) {
+		fflush(journal);
+		if (ftruncate(fileno(journal), 0))
+			perror("journal");
+		return;
+	}
+	name = hiddenname(filename, "journal");
+	unlink(name);
+	free(name);
+}
+
+/*
+ * the devices of the keys in a layout, at most MAXDEVICES; return their
+ * number, or -1 if they are more; the devices already found are in a hash
+ * table of twice that size
+ */
+int layoutdevices(struct layout *layout, struct remotedevice *devices,
+		int max) {
+	struct key *key;
+	int table[2 * MAXDEVICES];
+	unsigned hash;
+	int p, d, n;
+
+	if (max > MAXDEVICES)
+		max = MAXDEVICES;
+	for (d = 0; d < 2 * MAXDEVICES; d++)
+		table[d] = -1;
+
+	n = 0;
+	for (p = 0; p < layout->num; p++) {
+		key = layout->namedkey[p]->key;
+		if (key == NULL)
+			continue;
+		hash = key->protocol;
+		hash = hash * 31 + key->device;
+		hash = hash * 31 + key->subdevice;
+		for (d = hash % (2 * MAXDEVICES);
+		     table[d] != -1;
+		     d = (d + 1) % (2 * MAXDEVICES))
+			if (key->protocol == devices[table[d]].protocol &&
+			    key->device == devices[table[d]].device &&
+			    key->subdevice == devices[table[d]].subdevice)
+				break;
+		if (table[d] != -1)
 			continue;
+		if (n >= max)
+			return -1;
+		table[d] = n;
+		devices[n].protocol = key->protocol;
+		devices[n].device = key->device;
+		devices[n].subdevice = key->subdevice;
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * print the devices of the keys in a layout
+ */
+void layoutremoteprint(struct layout *layout) {
+	struct remotedevice devices[MAXDEVICES];
+	int d, n;
+	char device[100];
+
+	n = layoutdevices(layout, devices, MAXDEVICES);
+	if (n == -1)
+		printf("more than %d devices\n", MAXDEVICES);
+	for (d = 0; d < n; d++) {
 		device[0] = '\0';
-		appendprotocol(device, k1->key->protocol);
+		appendprotocol(device, devices[d].protocol);
 		strcat(device, ",");
-		appendcode(device, k1->key->device, k1->key->subdevice, '-');
+		appendcode(device, devices[d].device, devices[d].subdevice,
+			'-');
 		printf("%s\n", device);
-		
-		layoutadd(remote, k1);
 	}
+}
+
+/*
+ * a library of layouts, one per remote: the coded keys of all of them are in
+ * a single layout, so that its index resolves a key to all layouts that have
+ * it; file is the layout file of each position; the keys are owned by the
+ * layouts of the files
+ */
+#define MAXCOLLISIONS 16
+struct library {
+	struct layout *layout;
+	int *file;
+	char **files;
+	struct layout **layouts;
+	int nfiles;
+};
+
+int filecompare(const void *a, const void *b) {
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+/*
+ * read all layout files in a directory
+ */
+struct library *libraryread(char *dirname) {
+	struct library *library;
+	struct layout *layout;
+	struct namedkey *nk;
+	DIR *dir;
+	struct dirent *entry;
+	struct stat st;
+	char path[4096];
+	FILE *fd;
+	int f, pos, size;
+
+	dir = opendir(dirname);
+	if (dir == NULL) {
+		perror(dirname);
+		return NULL;
+	}
+	library = malloc(sizeof(struct library));
+	library->layout = layoutnew();
+	library->file = NULL;
+	library->files = NULL;
+	library->layouts = NULL;
+	library->nfiles = 0;
+
+	size = 0;
+	while ((entry = readdir(dir)) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
+		if (entry->d_name[0] == '.')	/* also caches */
+			continue;
+		if (stat(path, &st) || ! S_ISREG(st.st_mode))
+			continue;
+		if (library->nfiles >= size) {
+			size += 100;
+			library->files = realloc(library->files,
+				size * sizeof(char *));
+		}
+		library->files[library->nfiles++] = strdup(entry->d_name);
+	}
+	closedir(dir);
+	qsort(library->files, library->nfiles, sizeof(char *), filecompare);
+	library->layouts = malloc((library->nfiles + 1) *
+		sizeof(struct layout *));
+
+	for (f = 0; f < library->nfiles; f++) {
+		library->layouts[f] = NULL;
+		snprintf(path, sizeof(path), "%s/%s",
+			dirname, library->files[f]);
+		fd = fopen(path, "r");
+		if (fd == NULL) {
+			perror(path);
+			continue;
+		}
+		layout = layoutload(path, fd);
+		fclose(fd);
+		if (layout == NULL) {
+			printf("in file %s\n", path);
+			continue;
+		}
+		library->layouts[f] = layout;
 
-	free(remote->namedkey);
-	free(remote);
+		/* index the coded keys in the library */
+		for (pos = 0; pos < layout->num; pos++) {
+			nk = layout->namedkey[pos];
+			if (nk->key == NULL || isfiller(nk->name))
+				continue;
+			layoutadd(library->layout, nk);
+			library->file = realloc(library->file,
+				library->layout->size * sizeof(int));
+			library->file[library->layout->num - 1] = f;
+		}
+	}
+
+	return library;
+}
+
+/*
+ * deallocate a library
+ */
+void libraryfree(struct library *library) {
+	int f;
+
+	for (f = 0; f < library->nfiles; f++) {
+		if (library->layouts[f] != NULL)
+			layoutfree(library->layouts[f]);
+		free(library->files[f]);
+	}
+	library->layout->num = 0;
+	layoutfree(library->layout);
+	free(library->layouts);
+	free(library->files);
+	free(library->file);
+	free(library);
+}
+
+/*
+ * find all positions of a key in a library, in order; return their number
+ */
+int libraryfind(struct library *library, struct key *key,
+		int *found, int max) {
+	struct layout *layout;
+	int pos, n, i;
+
+	layout = library->layout;
+	n = 0;
+	pos = layout->keybucket[keyhash(key) & (layout->buckets - 1)];
+	for (; pos != -1; pos = layout->keynext[pos]) {
+		if (! keyequal(key, layout->namedkey[pos]->key, 0))
+			continue;
+		for (i = n; i > 0 && found[i - 1] > pos; i--)
+			if (i < max)
+				found[i] = found[i - 1];
+		if (i < max)
+			found[i] = pos;
+		if (n < max)
+			n++;
+	}
+
+	return n;
+}
+
+/*
+ * print the keys that are in more than one layout of a library
+ */
+void librarycollisions(struct library *library) {
+	struct layout *layout;
+	int found[MAXCOLLISIONS], n, pos, i, first;
+
+	layout = library->layout;
+	for (pos = 0; pos < layout->num; pos++) {
+		n = libraryfind(library, layout->namedkey[pos]->key,
+			found, MAXCOLLISIONS);
+		if (n < 2 || found[0] != pos)
+			continue;
+		first = 1;
+		for (i = 1; i < n; i++)
+			if (library->file[found[i]] != library->file[pos])
+				first = 0;
+		if (first)
+			continue;
+		printf("collision: ");
+		printkey(layout->namedkey[pos]->key);
+		printf("\n");
+		for (i = 0; i < n; i++)
+			printf("\t%s %s\n",
+				library->files[library->file[found[i]]],
+				layout->namedkey[found[i]]->name);
+	}
+}
+
+/*
+ * print the layouts and names of a key in a library
+ */
+void libraryprint(struct library *library, struct key *key) {
+	int found[MAXCOLLISIONS], n, i;
+
+	n = libraryfind(library, key, found, MAXCOLLISIONS);
+	if (n == 0) {
+		printf("not found: ");
+		printkey(key);
+		printf("\n");
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		printf("%s %s: ",
+			library->files[library->file[found[i]]],
+			library->layout->namedkey[found[i]]->name);
+		printkey(key);
+		printf("\n");
+	}
 }
 
 /*
@@ -388,39 +1256,46 @@ void layoutprint(struct layout *layout, int codes, int complete) {
 }
 
 /*
- * export a layout to csv
+ * export a layout to csv, one key per function in increasing order
  */
+struct csvkey {
+	int function;
+	int pos;
+};
+
+int csvcompare(const void *a, const void *b) {
+	const struct csvkey *ka = a, *kb = b;
+	if (ka->function != kb->function)
+		return ka->function < kb->function ? -1 : 1;
+	return ka->pos - kb->pos;
+}
+
 void layoutcsvprint(struct layout *layout) {
-	int pos, cur;
-	int prev, next;
+	struct csvkey *sorted;
+	int pos, n, cur;
 	struct key *ks;
 	char *name, *comma;
 	char protocol[100];
 	int16_t subdevice;
 
-	prev = -1;
-
-	while (1) {
-		next = -1;
-		for (pos = 0; pos < layout->num; pos++) {
-			name = layout->namedkey[pos]->name;
-			if (name[0] == '\n' || name[0] == ' ')
-				continue;
-			ks = layout->namedkey[pos]->key;
-			if (ks->function <= prev)
-				continue;
-			if (next == -1 || ks->function < next) {
-				next = ks->function;
-				cur = pos;
-			}
-		}
-		prev = next;
-		if (next == -1)
-			break;
+	/* the keys by function, and by position within the same function */
+	sorted = malloc((layout->num + 1) * sizeof(struct csvkey));
+	n = 0;
+	for (pos = 0; pos < layout->num; pos++) {
+		ks = layout->namedkey[pos]->key;
+		if (isfiller(layout->namedkey[pos]->name) || ks == NULL)
+			continue;
+		sorted[n].function = ks->function;
+		sorted[n].pos = pos;
+		n++;
+	}
+	qsort(sorted, n, sizeof(struct csvkey), csvcompare);
 
-		name = layout->namedkey[cur]->name;
-		if (name[0] == '\n' || name[0] == ' ')
+	for (cur = 0; cur < n; cur++) {
+		if (cur > 0 && sorted[cur].function == sorted[cur - 1].function)
 			continue;
+
+		name = layout->namedkey[sorted[cur].pos]->name;
 		comma = strchr(name, ',');
 		if (! comma)
 			printf("%s,", name);
@@ -428,7 +1303,7 @@ void layoutcsvprint(struct layout *layout) {
 			fwrite(name, 1, comma - name, stdout);
 			putchar(',');
 		}
-		ks = layout->namedkey[cur]->key;
+		ks = layout->namedkey[sorted[cur].pos]->key;
 		protocol[0] = '\0';
 		appendprotocol(protocol, ks->protocol);
 		printf("%s,", protocol);
@@ -437,6 +1312,8 @@ void layoutcsvprint(struct layout *layout) {
 		printf("%d,%d,%d", ks->device, subdevice, ks->function);
 		printf("\n");
 	}
+
+	free(sorted);
 }
 
 /*
@@ -496,15 +1373,27 @@ void movekey(int *pos, struct layout *layout, int direction, int skipknown) {
  */
 void usage() {
 	printf("usage:\n");
-	printf("\tlayout [-s] [-c] [-k] [-t] [-l [-f]] [-r] [-h]");
+	printf("\tlayout [-s] [-c] [-k] [-t] [-l [-f]] [-r] [-j] [-p file] [-e file]");
+	printf(" [-R n] [-S sizes] [-C socket] [-h]");
 	printf(" layout.txt [soundcard]\n");
+	printf("\tlayout [-l [-f]] [-p file] [-e file] [-R n] [-S sizes] ");
+	printf("[-C socket] -m directory [soundcard]\n");
 	printf("\t\t-s\t\tshow the layout of keys and terminate\n");
 	printf("\t\t-c\t\tomit codes when showing a layout\n");
 	printf("\t\t-k\t\tprint complete codes when showing a layout\n");
 	printf("\t\t-t\t\tprint layout in csv and terminate\n");
 	printf("\t\t-l\t\tlog input data to log.au\n");
 	printf("\t\t-f\t\twith, -f, log input data to log.txt\n");
-	printf("\t\t-r\t\tfind key names instead of saving them\n");
+	printf("\t\t-r\t\tfind key names instead of saving them; ");
+	printf("only decode\n\t\t\t\tthe devices in the layout\n");
+	printf("\t\t-m\t\tfind key names in all layouts in directory\n");
+	printf("\t\t-j\t\tjournal each key, instead of saving only at end\n");
+	printf("\t\t-p file\t\tread the protocols from file\n");
+	printf("\t\t-e file\t\twrite keys with samples and timing error\n");
+	printf("\t\t-R n\t\tread the soundcard at real-time priority n\n");
+	printf("\t\t-S sizes\tperiod,buffer,read frames of the soundcard, ");
+	printf("or low\n");
+	printf("\t\t-C socket\talso read commands from this unix socket\n");
 	printf("\t\t-h\t\tthis help\n");
 	printf("\t\tlayout.txt\tthe file that is read and written\n");
 	printf("\t\tsoundcard\tthe soundcard name\n");
@@ -516,20 +1405,28 @@ void usage() {
 int main(int argc, char *argv[]) {
 	int opt;
 	int showlayout, showcodes, showall, showcsv;
-	int ascii, readkeys;
-	char *layoutfile, *infile, *logfile;
-	FILE *layoutfd;
+	int ascii, readkeys, multiple, journaling, recovered, realtime;
+	struct library *library;
+	struct remotedevice devices[MAXDEVICES];
+	int ndevices;
+	char *layoutfile, *infile, *logfile, *protocolfile, *eventfile;
+	FILE *layoutfd, *events, *journal;
 	struct layout *layout;
 	struct status status;
 	void *microphone, *read, *filters;
-	int value;
+	struct microphone_counters counters;
+	struct microphone_sizes sizes = MICROPHONE_DEFAULT;
+	int value, values[BLOCKSIZE], nvalues, next;
+	long time;
 	struct protocols_status *protocols_status;
+	struct keyevent event;
 	struct key *key, *lastkey;
 	int pos, direction, increase;
 	int finish, save, skipknown;
 	struct termios original, raw;
-	pthread_t input;
-	volatile char command; // a mutex doesn't seem necessary
+	struct control control;
+	char *controlfile;
+	char command;
 
 					/* arguments */
 
@@ -540,7 +1437,13 @@ int main(int argc, char *argv[]) {
 	logfile = NULL;
 	ascii = 0;
 	readkeys = 0;
-	while (-1 != (opt = getopt(argc, argv, "skctlfrh")))
+	multiple = 0;
+	journaling = 0;
+	realtime = 0;
+	protocolfile = NULL;
+	eventfile = NULL;
+	controlfile = NULL;
+	while (-1 != (opt = getopt(argc, argv, "skctlfrmjp:e:R:S:C:h")))
 		switch (opt) {
 		case 's':
 			showlayout = 1;
@@ -564,6 +1467,31 @@ int main(int argc, char *argv[]) {
 		case 'r':
 			readkeys = 1;
 			break;
+		case 'm':
+			readkeys = 1;
+			multiple = 1;
+			break;
+		case 'j':
+			journaling = 1;
+			break;
+		case 'p':
+			protocolfile = optarg;
+			break;
+		case 'e':
+			eventfile = optarg;
+			break;
+		case 'R':
+			realtime = atoi(optarg);
+			break;
+		case 'S':
+			if (microphone_sizes(optarg, &sizes)) {
+				printf("invalid sizes: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'C':
+			controlfile = optarg;
+			break;
 		case 'h':
 			usage();
 			return EXIT_SUCCESS;
@@ -585,48 +1513,97 @@ int main(int argc, char *argv[]) {
 	else
 		infile = argv[2];
 
-					/* open and read layout file */
+					/* protocols, also for the keys in the layout */
 
-	layoutfd = fopen(layoutfile, "r+");
-	if (layoutfd == NULL) {
-		perror(layoutfile);
+	if (protocols_load(protocolfile))
 		exit(EXIT_FAILURE);
+
+					/* read all layouts in a directory */
+
+	library = NULL;
+	layoutfd = NULL;
+	if (multiple) {
+		library = libraryread(layoutfile);
+		if (library == NULL)
+			exit(EXIT_FAILURE);
+		printf("%d keys in %d layouts\n",
+			library->layout->num, library->nfiles);
+		librarycollisions(library);
+		layout = library->layout;
 	}
-	layout = layoutread(layoutfd);
-	if (showcsv) {
-		layoutcsvprint(layout);
-		return 0;
+
+					/* open and read layout file */
+
+	else {
+		layoutfd = fopen(layoutfile, "r+");
+		if (layoutfd == NULL) {
+			perror(layoutfile);
+			exit(EXIT_FAILURE);
+		}
+		layout = layoutload(layoutfile, layoutfd);
+		if (showcsv) {
+			layoutcsvprint(layout);
+			return 0;
+		}
+		layoutprint(layout, showcodes, showall);
+		if (showlayout)
+			return 0;
+	}
+
+					/* keys not saved last time, and journal */
+
+	journal = NULL;
+	if (! readkeys) {
+		recovered = journalreplay(layoutfile, layout);
+		if (recovered > 0)
+			printf("%d keys recovered from journal\n", recovered);
+		if (journaling)
+			journal = journalopen(layoutfile);
 	}
-	layoutprint(layout, showcodes, showall);
-	if (showlayout)
-		return 0;
 
 					/* init filters and protocols */
 
 	read = read_init(infile, ascii, &status);
 	if (read != NULL)
 		microphone = NULL;
+	else if (access(infile, F_OK) == 0) {	/* file, but not audio */
+		printf("cannot open input file\n");
+		exit(EXIT_FAILURE);
+	}
 	else {
-		microphone = microphone_init(infile, &status);
+		microphone = microphone_init(infile, &sizes, &status);
 		if (microphone == NULL) {
 			printf("cannot open input file\n");
 			exit(EXIT_FAILURE);
 		}
+		if (realtime > 0)
+			microphone_realtime(microphone, realtime);
+	}
+	filters = fastbest_init(logfile, &status);
+	ndevices = readkeys ?
+		layoutdevices(layout, devices, MAXDEVICES) : 0;
+	if (ndevices == -1)		/* too many: decode all */
+		ndevices = 0;
+	protocols_status = protocols_init(0, devices, ndevices);
+	events = NULL;
+	if (eventfile != NULL) {
+		events = fopen(eventfile, "w");
+		if (events == NULL) {
+			perror(eventfile);
+			exit(EXIT_FAILURE);
+		}
 	}
-	filters = best_init(logfile, &status);
-	protocols_status = protocols_init(0);
 	
-					/* start reading keyboard */
+					/* start reading commands */
 
+	if (controlopen(&control, controlfile))
+		exit(EXIT_FAILURE);
 	tcgetattr(STDIN_FILENO, &original);
 	raw = original;
 	cfmakeraw(&raw);
 	raw.c_oflag |= OPOST | ONLCR;
 	tcsetattr(STDIN_FILENO, TCSANOW, &raw);
 
-	command = '\0';
-	pthread_create(&input, NULL, keyboard, (void *) &command);
-
 					/* process microphone data */
 
 	pos = -1;
@@ -637,6 +1614,9 @@ int main(int argc, char *argv[]) {
 	increase = 1;
 	key = NULL;
 	lastkey = NULL;
+	nvalues = 0;
+	time = 0; // samples: the same offset as remote -b
+	next = 0;
 	while (! finish) {
 
 					/* move to next key in layout */
@@ -650,11 +1630,19 @@ int main(int argc, char *argv[]) {
 		}
 
 		do {
+			key = NULL; // do not free: already done OR in layout
+
+					/* wait for a command or for samples */
+
+			command = next == nvalues ?
+				waitevent(&control, microphone) : '\0';
 
 					/* process command, if any */
 
 			switch (command) {
 			case 'v':
+				if (multiple)
+					break;
 				layoutprint(layout, showcodes, showall);
 				if (! readkeys)
 					prompt(pos, layout);
@@ -671,8 +1659,10 @@ int main(int argc, char *argv[]) {
 			case 'w':
 				if (readkeys)
 					break;
-				layoutwrite(layoutfd, layout);
-				printf("saved!");
+				if (layout->dirty &&
+				    ! layoutsave(layoutfile, layout))
+					journalclear(layoutfile, journal);
+				printf(layout->dirty ? "not saved!" : "saved!");
 				prompt(pos, layout);
 				break;
 			case 'x':
@@ -690,32 +1680,58 @@ int main(int argc, char *argv[]) {
 			}
 			if (finish)
 				break;
-			command = '\0';
+			if (command != '\0')
+				continue;
 
 					/* get remote key from microphone */
 
-			key = NULL; // do not free: already done OR in layout
-			value = 0;
-			if (read)
-				FILTER_VALUE(read, value, read, &status)
-			if (microphone)
-				FILTER_VALUE(microphone, value, microphone,
-					&status)
-			FILTER_VALUE(best, value, filters, &status)
-			key = protocols_value(value, protocols_status);
-			if (key != NULL && key->repeat) {
-				free(key);
-				key = NULL;
+			if (next == nvalues) {
+				nvalues = BLOCKSIZE;
+				if (read)
+					FILTER_BLOCK(read, values, nvalues,
+						read, &status)
+				if (microphone)
+					FILTER_BLOCK(microphone, values, nvalues,
+						microphone, &status)
+				FILTER_BLOCK(fastbest, values, nvalues,
+					filters, &status)
+				next = 0;
+			}
+			if (next == nvalues) {
+				if (status.ended)
+					break;
+				continue;
+			}
+			time += abs(values[next]);
+			if (protocols_event(values[next++], time - 1 - 11 / 2,
+					protocols_status, &event)) {
+				if (microphone)
+					microphone_keylatency(microphone,
+						event.end);
+				if (events) {
+					printevent(events, &event);
+					fflush(events);
+				}
+				if (! event.key.repeat) {
+					key = malloc(sizeof(struct key));
+					*key = event.key;
+				}
 			}
 		} while (key == NULL);
 
 		if (finish)
+			break;
+		if (key == NULL)		/* end of input */
 			break;
 	
 
 					/* find and print key in layout */
 
-		if (readkeys) {
+		if (multiple) {
+			libraryprint(library, key);
+			free(key);
+		}
+		else if (readkeys) {
 			pos = layoutfind(layout, NULL, key);
 			if (pos == -1) {
 				printf("not found: ");
@@ -733,7 +1749,9 @@ int main(int argc, char *argv[]) {
 					/* add key to layout */
 
 		else if (! keyequal(key, lastkey, 0)) {
-			namedkeyreplace(layout->namedkey[pos], key);
+			layoutreplace(layout, pos, key);
+			if (journal != NULL)
+				journalappend(journal, layout, pos);
 			lastkey = key;
 			printnamedkey(layout->namedkey[pos]);
 			printf("\n");
@@ -749,9 +1767,11 @@ int main(int argc, char *argv[]) {
 
 	if (read)
 		read_end(read, &status);
-	if (microphone)
+	if (microphone) {
+		microphone_counters(microphone, &counters);
 		microphone_end(microphone, &status);
-	value = best_end(filters, &status);
+	}
+	value = fastbest_end(filters, &status);
 	if (! readkeys) {
 		protocols_value(value, protocols_status);
 		protocols_end(protocols_status);
@@ -759,16 +1779,27 @@ int main(int argc, char *argv[]) {
 
 					/* terminate */
 
-	layoutprint(layout, showcodes, showall);
-	if (save)
-		layoutwrite(layoutfd, layout);
-	fclose(layoutfd);
-	layoutfree(layout);
-
-//	pthread_kill(input, SIGTERM);
-//	pthread_join(input, NULL);
+	if (! multiple) {
+		layoutprint(layout, showcodes, showall);
+		if (save && layout->dirty)
+			layoutsave(layoutfile, layout);
+		if (journal != NULL)
+			fclose(journal);
+		if (! readkeys && (! save || ! layout->dirty))
+			journalclear(layoutfile, NULL);
+		fclose(layoutfd);
+	}
+	if (events)
+		fclose(events);
+	if (multiple)
+		libraryfree(library);
+	else
+		layoutfree(layout);
 
+	controlclose(&control);
 	tcsetattr(STDIN_FILENO, TCSANOW, &original);
+	if (microphone)
+		microphone_printcounters(stderr, &counters);
 	return EXIT_SUCCESS;
 }
 
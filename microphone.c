@@ -28,8 +28,19 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
 #include <alsa/asoundlib.h>
 #include "filters.h"
+#include "microphone.h"
 
 /*
  * set mixer to maximal capture level
@@ -75,9 +86,12 @@ int maxmixer(char *name) {
 }
 
 /*
- * open and configure sound output
+ * open and configure sound input; mmap access if *mmap and the soundcard
+ * allows it, otherwise read access; *mmap is set to which one is used; period
+ * and buffer are in frames, buffer 0 is the default of the soundcard
  */
-snd_pcm_t *audio(char *name, int frequency, int *channels) {
+snd_pcm_t *audio(char *name, int frequency, int period, int buffer,
+		int *channels, int *mmap) {
 	int res;
 	snd_pcm_t *handle;
 	snd_pcm_info_t *info;
@@ -85,7 +99,7 @@ snd_pcm_t *audio(char *name, int frequency, int *channels) {
 	unsigned int num, c;
 	snd_pcm_access_t a;
 	int den, dir;
-	snd_pcm_uframes_t frames = 32;
+	snd_pcm_uframes_t frames, size;
 
 	res = snd_pcm_open(&handle, name, SND_PCM_STREAM_CAPTURE, 0);
 	if (res < 0) {
@@ -97,6 +111,8 @@ snd_pcm_t *audio(char *name, int frequency, int *channels) {
 	res = snd_pcm_info(handle, info);
 	if (res < 0) {
 		fprintf(stderr, "snd_pcm_info: %s\n", strerror(-res));
+		snd_pcm_info_free(info);
+		snd_pcm_close(handle);
 		return NULL;
 	}
 	fprintf(stderr, "name: %s\n", snd_pcm_info_get_name(info));
@@ -107,13 +123,21 @@ snd_pcm_t *audio(char *name, int frequency, int *channels) {
 	res = snd_pcm_hw_params_set_rate(handle, params, frequency, 0);
 	if (res < 0)
 		fprintf(stderr, "set sample rate: %s\n", strerror(-res));
-	snd_pcm_hw_params_set_access(handle, params,
+	if (! *mmap || snd_pcm_hw_params_set_access(handle, params,
+					SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0)
+		snd_pcm_hw_params_set_access(handle, params,
 					SND_PCM_ACCESS_RW_INTERLEAVED);
 	snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16);
+	frames = period;
 	res = snd_pcm_hw_params_set_period_size_near(handle, params,
 			&frames, &dir);
 	if (res < 0)
 		fprintf(stderr, "set period size: %s\n", strerror(-res));
+	size = buffer;
+	res = buffer <= 0 ? 0 :
+		snd_pcm_hw_params_set_buffer_size_near(handle, params, &size);
+	if (res < 0)
+		fprintf(stderr, "set buffer size: %s\n", strerror(-res));
 	res = snd_pcm_hw_params_set_channels(handle, params, 1);
 	if (res < 0)
 		fprintf(stderr, "set channels: %s\n", strerror(-res));
@@ -121,6 +145,8 @@ snd_pcm_t *audio(char *name, int frequency, int *channels) {
 	res = snd_pcm_hw_params(handle, params);
 	if (res < 0) {
 		fprintf(stderr, "set hw parameters: %s\n", strerror(-res));
+		snd_pcm_hw_params_free(params);
+		snd_pcm_close(handle);
 		return NULL;
 	}
 
@@ -133,6 +159,11 @@ snd_pcm_t *audio(char *name, int frequency, int *channels) {
 		fprintf(stderr, "requested %d\n", frequency);
 	}
 
+	snd_pcm_hw_params_get_period_size(params, &frames, &dir);
+	snd_pcm_hw_params_get_buffer_size(params, &size);
+	fprintf(stderr, "period: %lu frames, buffer: %lu frames\n",
+		frames, size);
+
 	snd_pcm_hw_params_get_channels(params, &c);
 	fprintf(stderr, "channels: %d\n", c);
 	if (c != 1)
@@ -140,94 +171,705 @@ snd_pcm_t *audio(char *name, int frequency, int *channels) {
 	*channels = c;
 
 	snd_pcm_hw_params_get_access(params, &a);
-	if (a != SND_PCM_ACCESS_RW_INTERLEAVED)
+	if (a != SND_PCM_ACCESS_RW_INTERLEAVED &&
+	    a != SND_PCM_ACCESS_MMAP_INTERLEAVED)
 		fprintf(stderr,
 			"ERROR: interleaved access not allowed (%d)\n", a);
+	*mmap = a == SND_PCM_ACCESS_MMAP_INTERLEAVED;
+	fprintf(stderr, "access: %s\n", *mmap ? "mmap" : "read");
 
 	snd_pcm_hw_params_free(params);
 
 	res = snd_pcm_prepare(handle);
 	if (res < 0) {
 		fprintf(stderr, "prepare: %s\n", strerror(-res));
+		snd_pcm_close(handle);
 		return NULL;
 	}
 
+	/* with mmap access, capture does not start by itself */
+	if (*mmap) {
+		res = snd_pcm_start(handle);
+		if (res < 0) {
+			fprintf(stderr, "start: %s\n", strerror(-res));
+			snd_pcm_close(handle);
+			return NULL;
+		}
+	}
+
 	return handle;
 }
 
 /*
  * microphone filter
+ *
+ * the samples are read in one of three ways:
+ * - ACCESS_READ: by snd_pcm_readi() straight to the ring if the soundcard
+ *   has one channel, otherwise to buffer and then from there to the ring
+ * - ACCESS_MMAP: from the ring buffer of the soundcard straight to the ring,
+ *   by snd_pcm_mmap_begin() and snd_pcm_mmap_commit(); no copy in between
+ * - ACCESS_FILE: from file:name, raw 16-bit samples mapped in memory and read
+ *   in blocks of the read size like the soundcard is; this allows testing
+ *   without a soundcard
+ * - ACCESS_PIPE: from file:name when name is a fifo, read as it comes; a
+ *   program writing samples to it in time stands for a soundcard
+ *
+ * the read size is the maximal number of frames taken from the soundcard at
+ * time; with read access, it is also how many frames the first of them waits
+ * before being decoded; the low-latency preset reads few milliseconds at time
+ *
+ * this is done by a capture thread, so that the soundcard is read in time
+ * even when decoding or printing stalls; the thread puts the samples in the
+ * ring, from which microphone_block() takes them; only the thread writes
+ * head and only the filter writes tail, so that no lock is needed; when the
+ * ring is full the samples from the soundcard are dropped, while the thread
+ * waits for the samples from a file or a fifo
+ *
+ * the samples are written in the free part of the ring, which is up to two
+ * spans since it may wrap around; the samples from the soundcard that do not
+ * fit go to a third span, the spill, and are then dropped
+ *
+ * the thread signals the event descriptor after each block and at the end;
+ * microphone_block() clears it before looking at the ring and signals it
+ * again if it leaves samples there; this way it is readable exactly when
+ * samples are waiting or the capture ended, and both microphone_block() and
+ * the caller can wait for it by poll() instead of looking at the ring time
+ * after time
  */
 #define NFRAMES (32*256)
+#define RINGSIZE (1 << 17)
+#define ACCESS_READ 0
+#define ACCESS_MMAP 1
+#define ACCESS_FILE 2
+#define ACCESS_PIPE 3
 struct audiobuffer {
 	snd_pcm_t *handle;
 	int channels;
+	int access;
+	int rate;
+	int read;
 	int16_t buffer[NFRAMES * sizeof(int16_t)];
-	int pos;
+	snd_pcm_channel_area_t file;
+	size_t filesize;
+	snd_pcm_uframes_t fileframes;
+	snd_pcm_uframes_t fileoffset;
+	int fd;
+
+	pthread_t thread;
+	int16_t ring[RINGSIZE];
+	int16_t spill[NFRAMES];
+	atomic_ulong head;
+	atomic_ulong tail;
+	atomic_int stop;
+	atomic_int ended;
+	atomic_long frames;
+	atomic_long xruns;
+	atomic_long dropped;
+	atomic_long highwater;
+	atomic_llong origin;
+	int event;
+	double cputime;
+
+	long keys;
+	double latency;
+	double maxlatency;
 };
 
+/*
+ * monotonic time in nanoseconds
+ */
+long long nanoseconds() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
 snd_pcm_t *microphone_handle(void *internal) {
 	struct audiobuffer *buffer;
 	buffer = (struct audiobuffer *) internal;
 	return buffer->handle;
 }
 
-void *microphone_init(char *device, struct status *status) {
+/*
+ * signal and clear the event descriptor
+ */
+void eventsignal(struct audiobuffer *buffer) {
+	uint64_t one = 1;
+	if (write(buffer->event, &one, sizeof(one)) != sizeof(one))
+		perror("eventfd");
+}
+
+void eventclear(struct audiobuffer *buffer) {
+	uint64_t count;
+	if (read(buffer->event, &count, sizeof(count)) == -1 &&
+	    errno != EAGAIN)
+		perror("eventfd");
+}
+
+int microphone_fd(void *internal) {
 	struct audiobuffer *buffer;
-	int frequency;
+	buffer = (struct audiobuffer *) internal;
+	return buffer->event;
+}
 
-	status->ended = 1;
+int microphone_ready(void *internal) {
+	struct audiobuffer *buffer;
+	buffer = (struct audiobuffer *) internal;
+	return atomic_load_explicit(&buffer->head, memory_order_acquire) !=
+		atomic_load_explicit(&buffer->tail, memory_order_relaxed) ||
+		atomic_load_explicit(&buffer->ended, memory_order_acquire);
+}
 
-	buffer = malloc(sizeof(struct audiobuffer));
+/*
+ * file:name as a soundcard with mmap access, or with read access for a fifo
+ */
+int fileaudio(struct audiobuffer *buffer, char *name) {
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd == -1) {
+		perror(name);
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		perror(name);
+		close(fd);
+		return -1;
+	}
+	if (S_ISFIFO(st.st_mode)) {
+		buffer->handle = NULL;
+		buffer->channels = 1;
+		buffer->fd = fd;
+		buffer->access = ACCESS_PIPE;
+		fprintf(stderr, "access: pipe\n");
+		return 0;
+	}
+	if (st.st_size < 2) {
+		fprintf(stderr, "%s: no samples\n", name);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(name);
+		return -1;
+	}
 
-				/* set mixer */
+	buffer->handle = NULL;
+	buffer->channels = 1;
+	buffer->file.addr = map;
+	buffer->file.first = 0;
+	buffer->file.step = 16 * buffer->channels;
+	buffer->filesize = st.st_size;
+	buffer->fileframes = st.st_size / 2 / buffer->channels;
+	buffer->fileoffset = 0;
+	buffer->access = ACCESS_FILE;
+	fprintf(stderr, "access: file\n");
+	return 0;
+}
 
-	if (maxmixer(device))
-		fprintf(stderr, "WARNING: cannot maximize capture volume\n");
+/*
+ * where the frames of a block go: the free part of the ring, then the spill
+ */
+#define NSPANS 3
+struct span {
+	int16_t *addr;
+	int len;
+};
 
-				/* set pcm */
+/*
+ * copy frames, step samples apart, to the spans
+ */
+void spancopy(int16_t *p, int step, int n, struct span *span) {
+	int i, len;
+
+	for (; n > 0; span++) {
+		len = n < span->len ? n : span->len;
+		if (step == 1)
+			memcpy(span->addr, p, len * sizeof(int16_t));
+		else
+			for (i = 0; i < len; i++)
+				span->addr[i] = p[i * step];
+		p += len * step;
+		n -= len;
+	}
+}
 
-	frequency = 44100;
-	buffer->handle = audio(device, frequency, &buffer->channels);
-	if (buffer->handle == NULL)
-		exit(EXIT_FAILURE);
+/*
+ * from an area of the ring buffer of the soundcard to the spans
+ */
+void areablock(const snd_pcm_channel_area_t *area, snd_pcm_uframes_t offset,
+		int n, struct span *span) {
+	int16_t *p;
 
-	buffer->pos = NFRAMES;
-	status->ended = 0;
-	return buffer;
+	p = (int16_t *) ((char *) area->addr +
+		(area->first + offset * area->step) / 8);
+	spancopy(p, area->step / 16, n, span);
 }
 
-int microphone_value(int value, void *internal, struct status *status) {
-	struct audiobuffer *buffer;
-	int res;
-	int16_t v;
+/*
+ * block from mmap access: wait for some frames, copy at most n of them to the
+ * spans, and give them back to the soundcard
+ */
+int mmap_block(struct audiobuffer *buffer, int n, struct span *span) {
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail, res;
 	int channel = 0;
 
-	(void) value;
-	(void) status;
-
-	buffer = (struct audiobuffer *) internal;
+	while ((avail = snd_pcm_avail_update(buffer->handle)) <= 0) {
+		res = avail < 0 ? avail : snd_pcm_wait(buffer->handle, 1000);
+		if (res >= 0)
+			continue;
+		buffer->xruns++;
+		if (snd_pcm_recover(buffer->handle, res, 0) < 0 ||
+		    snd_pcm_start(buffer->handle) < 0) {
+			fprintf(stderr, "avail: %s\n", strerror(-res));
+			return -1;
+		}
+	}
 
-	if (buffer->pos < NFRAMES * buffer->channels) {
-		v = buffer->buffer[buffer->pos + channel];
-		buffer->pos += buffer->channels;
-		return v;
+	frames = avail < n ? avail : n;
+	res = snd_pcm_mmap_begin(buffer->handle, &areas, &offset, &frames);
+	if (res < 0) {
+		fprintf(stderr, "mmap begin: %s\n", strerror(-res));
+		return -1;
+	}
+	areablock(&areas[channel], offset, frames, span);
+	res = snd_pcm_mmap_commit(buffer->handle, offset, frames);
+	if (res < 0 || (snd_pcm_uframes_t) res != frames) {
+		buffer->xruns++;
+		snd_pcm_recover(buffer->handle, res < 0 ? res : -EPIPE, 0);
+		snd_pcm_start(buffer->handle);
 	}
+	return frames;
+}
+
+/*
+ * read frames from the soundcard; 0 on overrun
+ */
+snd_pcm_sframes_t readi(struct audiobuffer *buffer, int16_t *frames, int n) {
+	snd_pcm_sframes_t res;
 
-	res = snd_pcm_readi(buffer->handle, buffer->buffer, NFRAMES);
+	res = snd_pcm_readi(buffer->handle, frames, n);
 	if (res == -EPIPE) {
+		buffer->xruns++;
 		snd_pcm_recover(buffer->handle, res, 0);
-		return microphone_value(value, internal, status);
+		return 0;
 	}
 	else if (res < 0) {
 		fprintf(stderr, "readi: %s\n", strerror(-res));
 		return -1;
 	}
+	return res;
+}
+
+/*
+ * block from read access: with one channel the frames are read straight to
+ * the spans, one after the other; otherwise to buffer, and copied from there
+ */
+int readi_block(struct audiobuffer *buffer, int n, struct span *span) {
+	snd_pcm_sframes_t res;
+	int got, len;
+	int channel = 0;
+
+	if (n > NFRAMES)
+		n = NFRAMES;
 
-	buffer->pos = 0;
-	v = buffer->buffer[buffer->pos + channel];
-	buffer->pos += buffer->channels;
-	return v;
+	if (buffer->channels != 1) {
+		res = readi(buffer, buffer->buffer, n);
+		if (res > 0)
+			spancopy(buffer->buffer + channel, buffer->channels,
+				res, span);
+		return res;
+	}
+
+	for (got = 0; got < n; span++) {
+		len = n - got < span->len ? n - got : span->len;
+		if (len == 0)
+			continue;
+		res = readi(buffer, span->addr, len);
+		if (res <= 0)
+			return got > 0 ? got : res;
+		got += res;
+		if (res < len)
+			break;
+	}
+	return got;
+}
+
+/*
+ * block from file: at most n frames, like from the soundcard; 0 at end
+ */
+int file_block(struct audiobuffer *buffer, int n, struct span *span) {
+	snd_pcm_uframes_t frames;
+
+	frames = buffer->fileframes - buffer->fileoffset;
+	if (frames > (snd_pcm_uframes_t) n)
+		frames = n;
+	areablock(&buffer->file, buffer->fileoffset, frames, span);
+	buffer->fileoffset += frames;
+	return frames;
+}
+
+/*
+ * block from fifo: what is there, up to n frames, straight to the first two
+ * spans; 0 at end, also when stopped while the fifo is silent
+ */
+int pipe_block(struct audiobuffer *buffer, int n, struct span *span) {
+	struct pollfd wait;
+	struct iovec iov[2];
+	ssize_t res, size;
+	char *byte;
+	int count;
+
+	wait.fd = buffer->fd;
+	wait.events = POLLIN;
+	while (poll(&wait, 1, 100) == 0)
+		if (atomic_load_explicit(&buffer->stop, memory_order_relaxed))
+			return 0;
+
+	iov[0].iov_base = span[0].addr;
+	iov[0].iov_len = (n < span[0].len ? n : span[0].len) *
+		sizeof(int16_t);
+	n -= iov[0].iov_len / sizeof(int16_t);
+	iov[1].iov_base = span[1].addr;
+	iov[1].iov_len = (n < span[1].len ? n : span[1].len) *
+		sizeof(int16_t);
+	count = iov[1].iov_len > 0 ? 2 : 1;
+
+	size = readv(buffer->fd, iov, count);
+	if (size == -1) {
+		perror("fifo");
+		return 0;
+	}
+	if (size % 2 == 1) {
+		byte = (size_t) size < iov[0].iov_len ?
+			(char *) iov[0].iov_base + size :
+			(char *) iov[1].iov_base + size - iov[0].iov_len;
+		res = read(buffer->fd, byte, 1);
+		size += res == 1 ? 1 : -1;
+	}
+	return size / 2;
+}
+
+/*
+ * processor time used by a thread, in seconds
+ */
+double threadtime(pthread_t thread) {
+	clockid_t clock;
+	struct timespec t;
+
+	if (pthread_getcpuclockid(thread, &clock) ||
+	    clock_gettime(clock, &t))
+		return 0;
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * capture thread
+ */
+void *capture(void *internal) {
+	struct audiobuffer *buffer;
+	struct span span[NSPANS];
+	unsigned long head, tail, used, space, pos;
+	int n;
+
+	buffer = (struct audiobuffer *) internal;
+	head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+
+	while (! atomic_load_explicit(&buffer->stop, memory_order_relaxed)) {
+		tail = atomic_load_explicit(&buffer->tail,
+			memory_order_acquire);
+		while (buffer->access >= ACCESS_FILE &&
+		       head - tail + buffer->read > RINGSIZE &&
+		       ! atomic_load_explicit(&buffer->stop,
+				memory_order_relaxed)) {
+			usleep(1000);
+			tail = atomic_load_explicit(&buffer->tail,
+				memory_order_acquire);
+		}
+
+		space = RINGSIZE - (head - tail);
+		pos = head & (RINGSIZE - 1);
+		span[0].addr = buffer->ring + pos;
+		span[0].len = RINGSIZE - pos < space ? RINGSIZE - pos : space;
+		span[1].addr = buffer->ring;
+		span[1].len = space - span[0].len;
+		span[2].addr = buffer->spill;
+		span[2].len = NFRAMES;
+
+		n = buffer->access == ACCESS_FILE ?
+			file_block(buffer, buffer->read, span) :
+		    buffer->access == ACCESS_PIPE ?
+			pipe_block(buffer, buffer->read, span) :
+		    buffer->access == ACCESS_MMAP ?
+			mmap_block(buffer, buffer->read, span) :
+			readi_block(buffer, buffer->read, span);
+		if (n == 0 && buffer->access >= ACCESS_FILE)
+			break;
+		if (n < 0) {
+			usleep(10000);
+			continue;
+		}
+		buffer->frames += n;
+
+		if ((unsigned long) n > space) {
+			buffer->dropped += n - space;
+			n = space;
+		}
+
+		head += n;
+		atomic_store_explicit(&buffer->origin, nanoseconds() -
+			(long long) head * 1000000000 / buffer->rate,
+			memory_order_relaxed);
+		atomic_store_explicit(&buffer->head, head,
+			memory_order_release);
+		eventsignal(buffer);
+
+		used = head - tail;
+		if ((long) used > buffer->highwater)
+			buffer->highwater = used;
+	}
+
+	buffer->cputime = threadtime(pthread_self());
+	atomic_store_explicit(&buffer->ended, 1, memory_order_release);
+	eventsignal(buffer);
+	return NULL;
+}
+
+/*
+ * sizes of capture: period,buffer,read in frames, or low for the preset
+ */
+int microphone_sizes(char *string, struct microphone_sizes *sizes) {
+	struct microphone_sizes lowlatency = MICROPHONE_LOWLATENCY;
+	int period, buffer, read;
+
+	if (! strcmp(string, "low")) {
+		*sizes = lowlatency;
+		return 0;
+	}
+	if (sscanf(string, "%d,%d,%d", &period, &buffer, &read) != 3 ||
+	    period < 0 || buffer < 0 || read < 0 || read > NFRAMES)
+		return -1;
+	if (period > 0)
+		sizes->period = period;
+	if (buffer > 0)
+		sizes->buffer = buffer;
+	if (read > 0)
+		sizes->read = read;
+	return 0;
+}
+
+void *microphone_init(char *device, struct microphone_sizes *sizes,
+		struct status *status) {
+	struct microphone_sizes defaults = MICROPHONE_DEFAULT;
+	struct audiobuffer *buffer;
+	int frequency, mmap;
+
+	status->ended = 1;
+
+	buffer = malloc(sizeof(struct audiobuffer));
+	atomic_init(&buffer->head, 0);
+	atomic_init(&buffer->tail, 0);
+	atomic_init(&buffer->stop, 0);
+	atomic_init(&buffer->ended, 0);
+	atomic_init(&buffer->frames, 0);
+	atomic_init(&buffer->xruns, 0);
+	atomic_init(&buffer->dropped, 0);
+	atomic_init(&buffer->highwater, 0);
+	atomic_init(&buffer->origin, nanoseconds());
+	buffer->keys = 0;
+	buffer->latency = 0;
+	buffer->maxlatency = 0;
+	buffer->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (buffer->event == -1) {
+		perror("eventfd");
+		free(buffer);
+		return NULL;
+	}
+
+	if (sizes == NULL)
+		sizes = &defaults;
+	frequency = 44100;
+	buffer->rate = frequency;
+	buffer->read = sizes->read < 1 ? 1 :
+		sizes->read > NFRAMES ? NFRAMES : sizes->read;
+
+				/* file instead of soundcard */
+
+	if (! strncmp(device, "file:", 5)) {
+		if (fileaudio(buffer, device + 5)) {
+			close(buffer->event);
+			free(buffer);
+			return NULL;
+		}
+	}
+
+				/* set mixer and pcm */
+
+	else {
+		if (maxmixer(device))
+			fprintf(stderr,
+				"WARNING: cannot maximize capture volume\n");
+
+		mmap = 1;
+		buffer->handle = audio(device, frequency,
+			sizes->period, sizes->buffer, &buffer->channels, &mmap);
+		if (buffer->handle == NULL) {
+			close(buffer->event);
+			free(buffer);
+			return NULL;
+		}
+		buffer->access = mmap ? ACCESS_MMAP : ACCESS_READ;
+	}
+
+				/* start capture */
+
+	if (pthread_create(&buffer->thread, NULL, capture, buffer)) {
+		fprintf(stderr, "cannot start capture thread\n");
+		if (buffer->access == ACCESS_FILE)
+			munmap(buffer->file.addr, buffer->filesize);
+		else if (buffer->access == ACCESS_PIPE)
+			close(buffer->fd);
+		else
+			snd_pcm_close(buffer->handle);
+		close(buffer->event);
+		free(buffer);
+		return NULL;
+	}
+
+	status->ended = 0;
+	return buffer;
+}
+
+/*
+ * real-time priority of the capture thread
+ */
+int microphone_realtime(void *internal, int priority) {
+	struct audiobuffer *buffer;
+	struct sched_param param;
+	int res;
+
+	buffer = (struct audiobuffer *) internal;
+	param.sched_priority = priority;
+	res = pthread_setschedparam(buffer->thread, SCHED_FIFO, &param);
+	if (res)
+		fprintf(stderr, "real-time priority: %s\n", strerror(res));
+	return res;
+}
+
+/*
+ * counters of the capture thread
+ */
+void microphone_counters(void *internal,
+		struct microphone_counters *counters) {
+	struct audiobuffer *buffer;
+
+	buffer = (struct audiobuffer *) internal;
+	counters->frames = buffer->frames;
+	counters->xruns = buffer->xruns;
+	counters->dropped = buffer->dropped;
+	counters->highwater = buffer->highwater;
+	counters->ringsize = RINGSIZE;
+	counters->keys = buffer->keys;
+	counters->latency = buffer->keys == 0 ? 0 :
+		buffer->latency / buffer->keys;
+	counters->maxlatency = buffer->maxlatency;
+	counters->cputime = atomic_load_explicit(&buffer->ended,
+			memory_order_acquire) ?
+		buffer->cputime : threadtime(buffer->thread);
+}
+
+/*
+ * a key ended at sample offset of the input has been decoded: account the
+ * time elapsed since the soundcard captured that sample; this is estimated
+ * from the time and position of the last block from the soundcard, so it
+ * includes the wait for the read size; return it in milliseconds, or 0 for
+ * a file, which is read faster than it would be captured
+ */
+double microphone_keylatency(void *internal, long offset) {
+	struct audiobuffer *buffer;
+	long long origin;
+	double latency;
+
+	buffer = (struct audiobuffer *) internal;
+	if (buffer->access == ACCESS_FILE)
+		return 0;
+	origin = atomic_load_explicit(&buffer->origin, memory_order_relaxed);
+	latency = (nanoseconds() - origin -
+		(double) offset * 1000000000 / buffer->rate) / 1000000;
+	buffer->keys++;
+	buffer->latency += latency;
+	if (latency > buffer->maxlatency)
+		buffer->maxlatency = latency;
+	return latency;
+}
+
+void microphone_printcounters(FILE *out,
+		struct microphone_counters *counters) {
+	fprintf(out, "frames: %ld\n", counters->frames);
+	fprintf(out, "xruns: %ld\n", counters->xruns);
+	fprintf(out, "dropped frames: %ld\n", counters->dropped);
+	fprintf(out, "ring high-water: %ld of %ld frames\n",
+		counters->highwater, counters->ringsize);
+	fprintf(out, "capture time: %.3f seconds\n", counters->cputime);
+	if (counters->keys > 0)
+		fprintf(out, "key latency: %.1f ms average, %.1f ms max\n",
+			counters->latency, counters->maxlatency);
+}
+
+int microphone_block(int *in, int n, int *out, void *internal,
+		struct status *status) {
+	struct audiobuffer *buffer;
+	unsigned long head, tail;
+	struct pollfd wait;
+	int i;
+
+	(void) in;
+
+	buffer = (struct audiobuffer *) internal;
+	tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+
+	eventclear(buffer);
+	while ((head = atomic_load_explicit(&buffer->head,
+			memory_order_acquire)) == tail) {
+		if (atomic_load_explicit(&buffer->ended,
+				memory_order_acquire) &&
+		    atomic_load_explicit(&buffer->head,
+				memory_order_acquire) == tail) {
+			eventsignal(buffer);
+			status->ended = 1;
+			return 0;
+		}
+		wait.fd = buffer->event;
+		wait.events = POLLIN;
+		poll(&wait, 1, -1);
+		eventclear(buffer);
+	}
+
+	if (head - tail < (unsigned long) n)
+		n = head - tail;
+	for (i = 0; i < n; i++)
+		out[i] = buffer->ring[(tail + i) & (RINGSIZE - 1)];
+	atomic_store_explicit(&buffer->tail, tail + n, memory_order_release);
+	if (head != tail + n ||
+	    atomic_load_explicit(&buffer->ended, memory_order_acquire))
+		eventsignal(buffer);
+	return n;
+}
+
+int microphone_value(int value, void *internal, struct status *status) {
+	int out;
+
+	(void) value;
+
+	if (microphone_block(NULL, 1, &out, internal, status) == 1)
+		return out;
+	return 0;
 }
 
 int microphone_end(void *internal, struct status *status) {
@@ -238,6 +880,21 @@ int microphone_end(void *internal, struct status *status) {
 
 	buffer = (struct audiobuffer *) internal;
 
+	atomic_store(&buffer->stop, 1);
+	pthread_join(buffer->thread, NULL);
+	close(buffer->event);
+
+	if (buffer->access == ACCESS_FILE) {
+		munmap(buffer->file.addr, buffer->filesize);
+		free(buffer);
+		return 0;
+	}
+	if (buffer->access == ACCESS_PIPE) {
+		close(buffer->fd);
+		free(buffer);
+		return 0;
+	}
+
 	res = snd_pcm_close(buffer->handle);
 	if (res < 0) {
 		printf("close: %s\n", strerror(-res));
@@ -247,4 +904,3 @@ int microphone_end(void *internal, struct status *status) {
 	free(buffer);
 	return 0;
 }
-
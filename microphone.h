@@ -1,15 +1,69 @@
 #include <alsa/asoundlib.h>
 #include "filters.h"
 
+/*
+ * sizes of capture, in frames: period and buffer of the soundcard (buffer 0
+ * is the default of the soundcard), and maximal frames read at time; the
+ * default reads 8192 frames, 186 milliseconds at 44100Hz; the low-latency
+ * preset reads 128, less than 3 milliseconds
+ */
+struct microphone_sizes {
+	int period;
+	int buffer;
+	int read;
+};
+#define MICROPHONE_DEFAULT { 32, 0, 8192 }
+#define MICROPHONE_LOWLATENCY { 32, 1024, 128 }
+int microphone_sizes(char *string, struct microphone_sizes *sizes);
+
 /*
  * microphone filter
  */
-void *microphone_init(char *device, struct status *status);
+void *microphone_init(char *device, struct microphone_sizes *sizes,
+		struct status *status);
 int microphone_value(int value, void *internal, struct status *status);
+int microphone_block(int *in, int n, int *out, void *internal,
+		struct status *status);
 int microphone_end(void *internal, struct status *status);
 
+/*
+ * the soundcard is read by a thread of its own; it may run at real-time
+ * priority; its counters are the frames captured, the overruns of the
+ * soundcard, the frames lost because the filter did not take them in time
+ * and the maximal number of frames waiting for the filter; the latency is
+ * from the capture of the last sample of a key to its decoding, in
+ * milliseconds, for the keys passed to microphone_keylatency();
+ * keys from a file are not counted; cputime is the processor time used by
+ * the capture thread, in seconds
+ */
+struct microphone_counters {
+	long frames;
+	long xruns;
+	long dropped;
+	long highwater;
+	long ringsize;
+	long keys;
+	double latency;
+	double maxlatency;
+	double cputime;
+};
+int microphone_realtime(void *internal, int priority);
+double microphone_keylatency(void *internal, long offset);
+void microphone_counters(void *internal,
+		struct microphone_counters *counters);
+void microphone_printcounters(FILE *out,
+		struct microphone_counters *counters);
+
 /*
  * this is intended to be used only for select() or poll()
  */
 snd_pcm_t *microphone_handle(void *internal);
 
+/*
+ * the soundcard is polled by the capture thread; the descriptor for poll() is
+ * readable when samples are waiting or the capture ended, that is, when
+ * microphone_block() does not wait; the same is told by microphone_ready()
+ */
+int microphone_fd(void *internal);
+int microphone_ready(void *internal);
+
@@ -53,6 +53,9 @@
  * is restarted from the head of the array; only the current value is checked
  * for matching the start of the protocol and not the previous values
  *
+ * a protocol described with a beam is instead matched by a bounded set of
+ * hypotheses, which lifts both limitations; see beam_value()
+ *
  * the easiest way to parse all protocols at the same time is by calling
  * protocols_init(), protocols_value() and maybe printkey() and protocols_end()
  * for all input value; these simplified functions have the restriction that
@@ -66,6 +69,11 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <string.h>
+#include <limits.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD
+#endif
 #include "protocols.h"
 
 /*
@@ -175,6 +183,31 @@ void protocol_init(struct protocol_status *status) {
 	status->zero = 0;
 	status->one = 0;
 	status->encoding = 0;
+	status->start = 0;
+	status->error = 0;
+	status->pairs = 0;
+}
+
+/*
+ * relative distance of a value from the middle of a pair
+ */
+double deviation(int value, int a, int b) {
+	double middle, distance;
+	middle = (a + b) / 2.0;
+	if (middle == 0)
+		return 0;
+	distance = value > middle ? value - middle : middle - value;
+	return distance / (middle > 0 ? middle : -middle);
+}
+
+/*
+ * account the timing error of a value within a pair
+ */
+void protocol_error(struct protocol_status *status, double deviation) {
+	if (deviation < 0)
+		return;
+	status->error += deviation;
+	status->pairs++;
 }
 
 /*
@@ -184,11 +217,17 @@ int protocol_step(int *value,
 		struct protocol *protocol, struct protocol_status *status) {
 	int zero_value, one_value;
 	int iszero, isone, bit;
+	double zerodev, onedev;
 
-	/* reset encoding when parsing starts */
-	if (status->main == 0)
+	/* reset encoding and timing error when parsing starts */
+	if (status->main == 0) {
 		status->encoding = 0;
-	
+		status->error = 0;
+		status->pairs = 0;
+	}
+	zerodev = -1;
+	onedev = -1;
+
 	/* protocol requires a bit at this point: suspend parsing the main
 	 * sequence and parse bit 0 and bit 1 in parallel until one succedes or
 	 * both fail */
@@ -199,6 +238,10 @@ int protocol_step(int *value,
 		if (status->zero != fail) {
 			iszero = seqwithin(&zero_value,
 				protocol->zero, status->zero, protocol->max);
+			if (iszero == complete)
+				zerodev = deviation(*value,
+					protocol->zero[status->zero],
+					protocol->zero[status->zero + 1]);
 			if (iszero == fail)
 				status->zero = fail;
 			else {
@@ -213,6 +256,10 @@ int protocol_step(int *value,
 		if (status->one != fail) {
 			isone = seqwithin(&one_value, protocol->one,
 				status->one, protocol->max);
+			if (isone == complete)
+				onedev = deviation(*value,
+					protocol->one[status->one],
+					protocol->one[status->one + 1]);
 			if (isone == fail)
 				status->one = fail;
 			else {
@@ -240,6 +287,8 @@ int protocol_step(int *value,
 			return fail;
 		}
 
+		protocol_error(status, status->zero != fail ? zerodev : onedev);
+
 		/* neither bit 0 nor bit 1 is complete: proceed parsing */
 		if (status->zero != complete && status->one != complete)
 			return proceed;
@@ -260,12 +309,19 @@ int protocol_step(int *value,
 	}
 
 	/* protocol requires a value at this point, not a bit */
-	else if (seqwithin(value, protocol->main, status->main, protocol->max)
-			!= fail)
-		status->main += 2;
 	else {
-		status->main = 0;
-		return fail;
+		zero_value = *value;
+		iszero = seqwithin(value,
+			protocol->main, status->main, protocol->max);
+		if (iszero == fail) {
+			status->main = 0;
+			return fail;
+		}
+		if (iszero == complete)
+			protocol_error(status, deviation(zero_value,
+				protocol->main[status->main],
+				protocol->main[status->main + 1]));
+		status->main += 2;
 	}
 
 	/* check whether the sequence is complete; this has to be done before
@@ -346,160 +402,38 @@ int protocol_value_return(int value,
 }
 
 /*
- * print functions
+ * names of the protocols of the keys, in the order they are first given in
+ * the protocol file; the protocol of a key is its index here
  */
-void necxprint(int subprotocol, uint32_t encoding) {
-	int device, subdevice, function, subfunction;
-
-	encoding = bitreverse(encoding);
-
-	device =      (encoding >> 0)  & 0xFF;
-	subdevice =   (encoding >> 8)  & 0xFF;
-	function =    (encoding >> 16) & 0xFF;
-	subfunction = (encoding >> 24) & 0xFF;
-
-	printf("\nnec%d", subprotocol);
-
-	if (device == (~subdevice & 0xFF))
-		printf(" 0x%02X", device);
-	else
-		printf(" 0x%02X-0x%02X", device, subdevice);
-
-	if (function == (~subfunction & 0xFF))
-		printf(" 0x%02X", function);
-	else
-		printf(" 0x%02X-0x%02X",
-			function, subfunction);
-	
-	printf("\n");
-}
-void nec_print(uint32_t encoding) {
-	necxprint(1, encoding);
-}
-void nec2_print(uint32_t encoding) {
-	necxprint(2, encoding);
-}
-
-void necrepeat_print(uint32_t encoding) {
-	(void) encoding;
-	printf("\nnec [repeat]\n");
-}
-void nec2repeat_print(uint32_t encoding) {
-	(void) encoding;
-	printf("\nnec2 [repeat]\n");
-}
-
-void sharp_print(uint32_t encoding) {
-	uint32_t reverse, address, function;
-
-	printf("\nsharp 0x%08X ", encoding);
-	reverse = bitreverse(encoding);
-	address = (reverse >> 18) & 0x1F;
-	function = (reverse >> 23) & 0xFF;
-	if (! (encoding & 0x1))
-		function = ~function & 0xFF;
-	printf("0x%02X-0x%02X", address, function);
-	if ((encoding & 0x1) == 0)
-		printf(" [reversed]");
-	printf("\n");
-}
-
-void sony12_print(uint32_t encoding) {
-	printf("\nsony12 0x%08X\n", bitreverse(encoding) >> (12 + 8));
-}
-
-void sony20_print(uint32_t encoding) {
-	printf("\nsony20 0x%08X\n", bitreverse(encoding) >> 12);
-}
-
-void rc5_print(uint32_t encoding) {
-	printf("\nrc5 0x%08X ", encoding);
-	printf("0x%02X-", (encoding >> 6) & 0x1F);
-	printf("0x%02X\n", (encoding >> 0) & 0x3F);
+char *protocolnames[MAXPROTOCOLS];
+int nprotocolnames = 0;
+
+int protocolnumber(char *name) {
+	int i;
+	for (i = 0; i < nprotocolnames; i++)
+		if (! strcmp(protocolnames[i], name))
+			return i;
+	return -1;
 }
 
 /*
- * the protocols
+ * hash of the names of the protocols of the keys in their order, which is
+ * what the number in a struct key means; FNV-1a
  */
-struct protocol nec_protocol = {
-	{ 380, 430, -180, -220,
-	  BIT, BIT, BIT, BIT, BIT, BIT, BIT, BIT,
-	  BIT, BIT, BIT, BIT, BIT, BIT, BIT, BIT,
-	  BIT, BIT, BIT, BIT, BIT, BIT, BIT, BIT,
-	  BIT, BIT, BIT, BIT, BIT, BIT, BIT, BIT,
-	  20, 30, END },
-	{ 20, 30, -20, -30, END },
-	{ 20, 30, -70, -80, END },
-	430
-};
-
-struct protocol necrepeat_protocol = {
-	{ 380, 430, -90, -110, 20, 30, END },
-	{},
-	{},
-	430
-};
-
-struct protocol nec2_protocol = {
-	{ 180, 220, -180, -220,
-	  BIT, BIT, BIT, BIT, BIT, BIT, BIT, BIT,
-	  BIT, BIT, BIT, BIT, BIT, BIT, BIT, BIT,
-	  BIT, BIT, BIT, BIT, BIT, BIT, BIT, BIT,
-	  BIT, BIT, BIT, BIT, BIT, BIT, BIT, BIT,
-	  20, 30, END },
-	{ 20, 30, -20, -30, END },
-	{ 20, 30, -70, -80, END },
-	220
-};
-
-struct protocol nec2repeat_protocol = {
-	{ 180, 220, -90, -110, 20, 30, END },
-	{},
-	{},
-	220
-};
-
-struct protocol sharp_protocol = {
-	{
-	  BIT, BIT, BIT, BIT, BIT,
-	  BIT, BIT, BIT, BIT, BIT, BIT, BIT, BIT,
-	  BIT, 8, 18, END },
-	{ 8, 18, -28, -38, END },
-	{ 8, 18, -73, -82, END },
-	73
-};
-
-struct protocol sony12_protocol = {
-	{ 90, 120,
-	  BIT, BIT, BIT, BIT, BIT, BIT, BIT,
-	  BIT, BIT, BIT, BIT, BIT,
-	  -900, -1200, END },
-	{ -20, -32, 20, 32, END },
-	{ -20, -32, 48, 58, END },
-	120
-};
-
-struct protocol sony20_protocol = {
-	{ 90, 120,
-	  BIT, BIT, BIT, BIT, BIT, BIT, BIT,
-	  BIT, BIT, BIT, BIT, BIT,
-	  BIT, BIT, BIT, BIT, BIT, BIT, BIT, BIT,
-	  END },
-	{ -20, -32, 20, 32, END },
-	{ -20, -32, 48, 58, END },
-	120
-};
-
-struct protocol rc5_protocol = {
-	{ 35, 45,
-	  BIT, BIT,
-	  BIT, BIT, BIT, BIT, BIT,
-	  BIT, BIT, BIT, BIT, BIT, BIT,
-	  END },
-	{ 35, 45, -35, -45, END },
-	{ -35, -45, 35, 45, END },
-	45 * 2
-};
+uint32_t protocols_hash() {
+	uint32_t hash;
+	char *c;
+	int i;
+
+	hash = 2166136261U;
+	for (i = 0; i < nprotocolnames; i++)
+		for (c = protocolnames[i]; ; c++) {
+			hash = (hash ^ (unsigned char) *c) * 16777619U;
+			if (*c == '\0')
+				break;
+		}
+	return hash;
+}
 
 /*
  * from string to key
@@ -521,18 +455,7 @@ struct key *stringtokey(char *string, char sep, char subsep) {
 
 	token = strsep(&comma, sepstring);
 
-	if (! strcmp(token, "nec"))
-		key->protocol = nec;
-	else if (! strcmp(token, "nec2"))
-		key->protocol = nec2;
-	else if (! strcmp(token, "sharp"))
-		key->protocol = sharp;
-	else if (! strcmp(token, "sony12"))
-		key->protocol = sony12;
-	else if (! strcmp(token, "sony20"))
-		key->protocol = sony20;
-	else if (! strcmp(token, "rc5"))
-		key->protocol = rc5;
+	key->protocol = protocolnumber(token);
 
 	token = strsep(&comma, sepstring);
 
@@ -598,32 +521,8 @@ struct key *stringtokey(char *string, char sep, char subsep) {
  * append protocol to string
  */
 void appendprotocol(char *string, int protocol) {
-	switch (protocol) {
-	case nec:
-		strcat(string, "nec");
-		break;
-	case necrepeat:
-		strcat(string, "necrepeat");
-		break;
-	case nec2:
-		strcat(string, "nec2");
-		break;
-	case nec2repeat:
-		strcat(string, "nec2repeat");
-		break;
-	case sharp:
-		strcat(string, "sharp");
-		break;
-	case sony12:
-		strcat(string, "sony12");
-		break;
-	case sony20:
-		strcat(string, "sony20");
-		break;
-	case rc5:
-		strcat(string, "rc5");
-		break;
-	}
+	if (protocol >= 0 && protocol < nprotocolnames)
+		strcat(string, protocolnames[protocol]);
 }
 
 /*
@@ -644,6 +543,49 @@ void appendcode(char *string, int code, int sub, char subsep) {
 	}
 }
 
+/*
+ * from string to device: protocol,device-subdevice or just protocol
+ */
+int stringtodevice(char *string, struct remotedevice *device) {
+	char *copy, *comma, *token, *sub, *invalid;
+
+	copy = strdup(string);
+	comma = copy;
+
+	token = strsep(&comma, ",");
+	device->protocol = protocolnumber(token);
+	device->device = -1;
+	device->subdevice = -1;
+	if (device->protocol == -1) {
+		free(copy);
+		return -1;
+	}
+
+	token = strsep(&comma, ",");
+	if (token == NULL) {
+		free(copy);
+		return 0;
+	}
+
+	sub = strsep(&token, "-");
+	device->device = strtol(sub, &invalid, 0);
+	if (*sub == '\0' || *invalid != '\0') {
+		free(copy);
+		return -1;
+	}
+	sub = strsep(&token, "-");
+	if (sub != NULL) {
+		device->subdevice = strtol(sub, &invalid, 0);
+		if (*sub == '\0' || *invalid != '\0') {
+			free(copy);
+			return -1;
+		}
+	}
+
+	free(copy);
+	return comma == NULL ? 0 : -1;
+}
+
 /*
  * from key to string
  */
@@ -682,6 +624,17 @@ void printkey(struct key *key) {
 	return;
 }
 
+/*
+ * print a key event: first and last sample, key and timing error in percent
+ */
+void printevent(FILE *out, struct keyevent *event) {
+	char *string;
+	string = keytostring(&event->key, ',', '-');
+	fprintf(out, "%ld %ld %s %.1f\n",
+		event->start, event->end, string, event->error * 100);
+	free(string);
+}
+
 /*
  * comparison of keys
  */
@@ -708,191 +661,1567 @@ int keyequal(struct key *a, struct key *b, int comparerepeat) {
 }
 
 /*
- * from encoding to key
+ * a protocol compiled for matching
+ *
+ * each pair of its sequences is turned into the range of values within it,
+ * the range of values over it and the amount consumed when over, so that
+ * matching a value no longer interprets the pairs; the values that do not
+ * fail the first step of the protocol are a few ranges, so that a matcher
+ * that is not in the middle of a sequence rejects most values by a few
+ * comparisons
  */
-void necsub(uint32_t encoding, int offset, int *code, int *sub) {
-	*code = (bitreverse(encoding) >> (0 + offset))  & 0xFF;
-	*sub =  (bitreverse(encoding) >> (8 + offset))  & 0xFF;
-	if (*code == (~*sub & 0xFF))
-		*sub = -1;
+#define PAIR_RANGE 0
+#define PAIR_BIT   1
+#define PAIR_END   2
+
+struct pair {
+	int type;
+	int withinmin, withinmax;
+	int overmin, overmax;
+	int half;
+	double middle, scale;
+};
+
+#define MAXSTART 4
+struct compiled {
+	struct pair main[50];
+	struct pair zero[10];
+	struct pair one[10];
+	int max;
+	int startmin[MAXSTART];
+	int startmax[MAXSTART];
+	int nstart;
+	int patternmin[2][2];
+	int patternmax[2][2];
+	int npattern[2];
+};
+
+void compilepair(struct pair *pair, int a, int b) {
+	pair->type = a == first(END) && b == second(END) ? PAIR_END :
+	             a == first(BIT) && b == second(BIT) ? PAIR_BIT :
+	             PAIR_RANGE;
+
+	/* within(): empty if a == b */
+	pair->withinmin = a < b ? a : b;
+	pair->withinmax = a < b ? b : a;
+	if (a == b) {
+		pair->withinmin = 1;
+		pair->withinmax = 0;
+	}
+
+	/* over(): beyond both a and b, each in its own sign */
+	pair->overmin = INT_MIN;
+	pair->overmax = INT_MAX;
+	if (a > 0 && pair->overmin < a)
+		pair->overmin = a;
+	if (a < 0 && pair->overmax > a)
+		pair->overmax = a;
+	if (b > 0 && pair->overmin < b)
+		pair->overmin = b;
+	if (b < 0 && pair->overmax > b)
+		pair->overmax = b;
+
+	pair->half = (a + b) / 2;
+
+	/* for the timing error */
+	pair->middle = (a + b) / 2.0;
+	pair->scale = pair->middle == 0 ? 0 :
+		1 / (pair->middle > 0 ? pair->middle : -pair->middle);
 }
 
-struct key *necxkey(uint32_t encoding, int protocol) {
-	struct key *key;
-	key = malloc(sizeof(struct key));
-	key->protocol = protocol;
-	necsub(encoding, 0, &key->device, &key->subdevice);
-	necsub(encoding, 16, &key->function, &key->subfunction);
-	key->repeat = 0;
-	return key;
+/*
+ * same as deviation(), on a compiled pair
+ */
+double pairdeviation(int value, struct pair *pair) {
+	double distance;
+	distance = value - pair->middle;
+	return (distance > 0 ? distance : -distance) * pair->scale;
 }
 
-struct key *necxrepeatkey(uint32_t encoding, int protocol) {
-	struct key *key;
-	(void) encoding;
-	key = malloc(sizeof(struct key));
-	key->protocol = protocol;
-	key->device =      -1;
-	key->subdevice =   -1;
-	key->function =    -1;
-	key->subfunction = -1;
-	key->repeat =      1;
-	return key;
+/*
+ * the values that do not fail a pair at the start of a sequence
+ */
+void compilestart(struct compiled *compiled, struct pair *pair) {
+	int n;
+
+	n = compiled->nstart;
+	if (pair->withinmin <= pair->withinmax) {
+		compiled->startmin[n] = pair->withinmin;
+		compiled->startmax[n] = pair->withinmax;
+		n++;
+	}
+	compiled->startmin[n] = pair->overmin > -compiled->max + 1 ?
+		pair->overmin : -compiled->max + 1;
+	compiled->startmax[n] = pair->overmax < compiled->max - 1 ?
+		pair->overmax : compiled->max - 1;
+	if (compiled->startmin[n] <= compiled->startmax[n])
+		n++;
+	compiled->nstart = n;
 }
 
-struct key *neckey(uint32_t encoding) {
-	return necxkey(encoding, nec);
+/*
+ * the values within a pair as one of the first two values of the protocol
+ */
+void compilepattern(struct compiled *compiled, int step, struct pair *pair) {
+	int n;
+
+	n = compiled->npattern[step];
+	if (pair->type != PAIR_RANGE || pair->withinmin > pair->withinmax ||
+	    n >= 2)
+		return;
+	compiled->patternmin[step][n] = pair->withinmin;
+	compiled->patternmax[step][n] = pair->withinmax;
+	compiled->npattern[step]++;
 }
-struct key *necrepeatkey(uint32_t encoding) {
-	return necxrepeatkey(encoding, nec);
+
+void protocol_compile(struct compiled *compiled, struct protocol *protocol) {
+	int i;
+
+	for (i = 0; i < 50; i++)
+		compilepair(&compiled->main[i],
+			protocol->main[2 * i], protocol->main[2 * i + 1]);
+	for (i = 0; i < 10; i++) {
+		compilepair(&compiled->zero[i],
+			protocol->zero[2 * i], protocol->zero[2 * i + 1]);
+		compilepair(&compiled->one[i],
+			protocol->one[2 * i], protocol->one[2 * i + 1]);
+	}
+	compiled->max = protocol->max;
+
+	compiled->nstart = 0;
+	if (compiled->main[0].type == PAIR_BIT) {
+		compilestart(compiled, &compiled->zero[0]);
+		compilestart(compiled, &compiled->one[0]);
+	}
+	else
+		compilestart(compiled, &compiled->main[0]);
+
+	compiled->npattern[0] = 0;
+	compiled->npattern[1] = 0;
+	if (compiled->main[0].type == PAIR_BIT) {
+		compilepattern(compiled, 0, &compiled->zero[0]);
+		compilepattern(compiled, 0, &compiled->one[0]);
+		compilepattern(compiled, 1, &compiled->zero[1]);
+		compilepattern(compiled, 1, &compiled->one[1]);
+	}
+	else {
+		compilepattern(compiled, 0, &compiled->main[0]);
+		if (compiled->main[1].type == PAIR_BIT) {
+			compilepattern(compiled, 1, &compiled->zero[0]);
+			compilepattern(compiled, 1, &compiled->one[0]);
+		}
+		else
+			compilepattern(compiled, 1, &compiled->main[1]);
+	}
 }
-struct key *nec2key(uint32_t encoding) {
-	return necxkey(encoding, nec2);
+
+/*
+ * whether two consecutive values are within the first two pairs of the
+ * protocol, as its start pattern
+ */
+int patternwithin(struct compiled *compiled, int step, int value) {
+	int i;
+	for (i = 0; i < compiled->npattern[step]; i++)
+		if (compiled->patternmin[step][i] <= value &&
+		    value <= compiled->patternmax[step][i])
+			return 1;
+	return 0;
 }
-struct key *nec2repeatkey(uint32_t encoding) {
-	return necxrepeatkey(encoding, nec2);
+
+int protocol_pattern(struct compiled *compiled, int previous, int value) {
+	return compiled->npattern[0] > 0 &&
+		patternwithin(compiled, 0, previous) &&
+		(compiled->npattern[1] == 0 ||
+		 patternwithin(compiled, 1, value));
 }
 
-struct key *sharpkey(uint32_t encoding) {
-	struct key *key;
+/*
+ * same as seqwithin(), on a compiled pair
+ */
+int pairwithin(int *value, struct pair *pair, int pos, int max) {
+	if (pair->withinmin <= *value && *value <= pair->withinmax) {
+		*value = 0;
+		return complete;
+	}
+	if (pair->overmin <= *value && *value <= pair->overmax &&
+	   (pos > 0 || abs(*value) < max)) {
+		*value -= pair->half;
+		return proceed;
+	}
+	*value = 0;
+	return fail;
+}
 
-	key = malloc(sizeof(struct key));
-	key->protocol =    sharp;
-	key->device =      (bitreverse(encoding) >> 18) & 0x1F;
-	key->subdevice =   -1;
-	key->function =    (bitreverse(encoding) >> 23) & 0xFF;
-	key->subfunction = -1;
-	if (! (encoding & 0x1))
-		key->function = ~key->function & 0xFF;
-	key->repeat = (encoding & 0x1) == 0;
-	return key;
+/*
+ * same as protocol_step(), on a compiled protocol
+ */
+int compiled_step(int *value,
+		struct compiled *compiled, struct protocol_status *status) {
+	struct pair *pair;
+	int zero_value, one_value;
+	int iszero, isone, bit;
+	double zerodev, onedev;
+
+	iszero = fail;
+	isone = fail;
+	zerodev = -1;
+	onedev = -1;
+
+	if (status->main == 0) {
+		status->encoding = 0;
+		status->error = 0;
+		status->pairs = 0;
+	}
+
+	if (compiled->main[status->main / 2].type == PAIR_BIT) {
+
+		zero_value = *value;
+		if (status->zero != fail) {
+			pair = &compiled->zero[status->zero / 2];
+			iszero = pairwithin(&zero_value, pair,
+				status->zero, compiled->max);
+			if (iszero == complete)
+				zerodev = pairdeviation(*value, pair);
+			if (iszero == fail)
+				status->zero = fail;
+			else {
+				status->zero += 2;
+				if (compiled->zero[status->zero / 2].type ==
+				    PAIR_END)
+					status->zero = complete;
+			}
+		}
+
+		one_value = *value;
+		if (status->one != fail) {
+			pair = &compiled->one[status->one / 2];
+			isone = pairwithin(&one_value, pair,
+				status->one, compiled->max);
+			if (isone == complete)
+				onedev = pairdeviation(*value, pair);
+			if (isone == fail)
+				status->one = fail;
+			else {
+				status->one += 2;
+				if (compiled->one[status->one / 2].type ==
+				    PAIR_END)
+					status->one = complete;
+			}
+		}
+
+		*value = absmin(zero_value, one_value);
+		if (zero_value != *value)
+			status->zero = fail;
+		if (one_value != *value)
+			status->one = fail;
+
+		if (status->zero == fail && status->one == fail) {
+			*value = 0;
+			status->zero = 0;
+			status->one = 0;
+			status->main = 0;
+			return fail;
+		}
+
+		protocol_error(status, status->zero != fail ? zerodev : onedev);
+
+		if (status->zero != complete && status->one != complete)
+			return proceed;
+
+		bit = 1;
+		if (status->zero == complete)
+			if (iszero == complete || isone != complete)
+				bit = 0;
+		if (status->one == complete)
+			if (isone == complete || iszero != complete)
+				bit = 1;
+		status->encoding = (status->encoding << 1) | bit;
+		status->zero = 0;
+		status->one = 0;
+		status->main += 2;
+	}
+
+	else {
+		pair = &compiled->main[status->main / 2];
+		zero_value = *value;
+		iszero = pairwithin(value, pair, status->main, compiled->max);
+		if (iszero == fail) {
+			status->main = 0;
+			return fail;
+		}
+		if (iszero == complete)
+			protocol_error(status,
+				pairdeviation(zero_value, pair));
+		status->main += 2;
+	}
+
+	if (compiled->main[status->main / 2].type == PAIR_END) {
+		status->main = 0;
+		return complete;
+	}
+	return proceed;
 }
 
-struct key *sonykey(int protocol, uint32_t reversed) {
-	struct key *key;
+/*
+ * same as protocol_value_return(), on a compiled protocol and without
+ * debugging; the restart is a loop instead of a recursive call; a sequence
+ * starting at the value is marked with the first sample of the value
+ */
+int compiled_value(int value, long start,
+		struct compiled *compiled, struct protocol_status *status) {
+	int res, part, restart, i;
+
+	while (1) {
+		if (status->main == 0 && status->zero == 0 && status->one == 0) {
+			for (i = 0; i < compiled->nstart; i++)
+				if (compiled->startmin[i] <= value &&
+				    value <= compiled->startmax[i])
+					break;
+			if (i == compiled->nstart)
+				return 0;
+			status->start = start;
+		}
 
-	key = malloc(sizeof(struct key));
-	key->protocol = protocol;
-	key->device = (reversed >> 7) & 0x1F;
-	key->subdevice = reversed >> (7 + 5);
-	key->function = reversed & 0x7F;
-	key->subfunction = 0;
-	key->repeat = 0;
+		restart = status->main != 0;
+		part = value;
+		do {
+			res = compiled_step(&part, compiled, status);
+			if (res == complete)
+				return 1;
+		} while (part != 0 && res != fail);
 
-	return key;
+		if (res != fail || ! restart)
+			return 0;
+	}
 }
-struct key *sony12key(uint32_t encoding) {
-	return sonykey(sony12, bitreverse(encoding) >> (12 + 8));
+
+/*
+ * a protocol matched by a beam of hypotheses
+ *
+ * this lifts the limitations of the deterministic parser: each bit is tried
+ * both as 0 and 1 by two hypotheses, each keeping its own rest of the value;
+ * and a new hypothesis starts at every value that may start the protocol,
+ * while the ones started at the previous values continue; a hypothesis is
+ * dropped when it fails, or when it is identical to a previous one, or when
+ * the beam is full; the hypotheses are kept in order of age, so that the
+ * oldest are the last dropped
+ *
+ * the cost is capped at BEAMSTEPS steps per hypothesis for each value
+ */
+#define MAXBEAM 8
+#define BEAMSTEPS 8
+
+struct beam {
+	struct protocol_status hypothesis[MAXBEAM];
+	int n;
+	long values;
+	long steps;
+	int maxsteps;
+};
+
+int sameprotocolstatus(struct protocol_status *a, struct protocol_status *b) {
+	return a->main == b->main && a->zero == b->zero && a->one == b->one &&
+		a->encoding == b->encoding;
 }
-struct key *sony20key(uint32_t encoding) {
-	return sonykey(sony20, bitreverse(encoding) >> 12);
+
+/*
+ * add a hypothesis to the next beam, unless idle, repeated or beyond width
+ */
+void beamadd(struct protocol_status *next, int *nnext, int width,
+		struct protocol_status *status) {
+	int i;
+
+	if (status->main == 0 && status->zero == 0 && status->one == 0)
+		return;
+	for (i = 0; i < *nnext; i++)
+		if (sameprotocolstatus(&next[i], status))
+			return;
+	if (*nnext < width)
+		next[(*nnext)++] = *status;
 }
 
-struct key *rc5key(uint32_t encoding) {
-	struct key *key;
+/*
+ * process a value by all hypotheses, and by a new one starting at the first
+ * sample of the value if fresh is true; return 1 and the hypothesis if it
+ * completes the protocol
+ */
+int beam_value(int value, long start, struct compiled *compiled, int width,
+		struct beam *beam, int fresh, struct protocol_status *completed,
+		int debug) {
+	struct protocol_status next[MAXBEAM], stack[MAXBEAM * BEAMSTEPS + 2];
+	struct protocol_status status;
+	int part[MAXBEAM * BEAMSTEPS + 2];
+	int nnext, nstack, h, p, steps, res;
+
+	nnext = 0;
+	steps = 0;
+	res = fail;
+	for (h = 0; h <= beam->n && steps < width * BEAMSTEPS; h++) {
+		if (h < beam->n)
+			stack[0] = beam->hypothesis[h];
+		else if (fresh) {
+			protocol_init(&stack[0]);
+			stack[0].start = start;
+		}
+		else
+			break;
+		part[0] = value;
+
+		for (nstack = 1; nstack > 0; ) {
+			nstack--;
+			status = stack[nstack];
+			p = part[nstack];
+			if (p == 0) {
+				beamadd(next, &nnext, width, &status);
+				continue;
+			}
+			if (steps >= width * BEAMSTEPS)
+				break;
+
+			/* a bit: the hypothesis of 1 is tried after the one of 0 */
+			if (compiled->main[status.main / 2].type == PAIR_BIT &&
+			    status.zero != fail && status.one != fail) {
+				stack[nstack] = status;
+				stack[nstack].zero = fail;
+				part[nstack++] = p;
+				status.one = fail;
+			}
 
-	key = malloc(sizeof(struct key));
-	key->protocol =    rc5;
-	key->device =      (encoding >> 6) & 0x1F;
-	key->subdevice =   -1;
-	key->function =    (encoding >> 0) & 0x3F;
-	key->subfunction = -1;
-	key->repeat =      (encoding >> 11) & 0x01;		// FIXME
-	return key;
+			steps++;
+			res = compiled_step(&p, compiled, &status);
+			if (res == complete) {
+				*completed = status;
+				nnext = 0;
+				break;
+			}
+			if (res == fail)
+				continue;
+			stack[nstack] = status;
+			part[nstack++] = p;
+		}
+		if (res == complete)
+			break;
+	}
+
+	memcpy(beam->hypothesis, next, nnext * sizeof(struct protocol_status));
+	beam->n = nnext;
+	beam->values++;
+	beam->steps += steps;
+	if (beam->maxsteps < steps)
+		beam->maxsteps = steps;
+	if (debug)
+		printf("%8d\t%d hypotheses\t%d steps%s\n", value, nnext, steps,
+			res == complete ? "\tcomplete" : "");
+	return res == complete;
+}
+
+/*
+ * a field of a key from the bits of the encoding: a constant, or some bits
+ * of the encoding or of its reverse, maybe complemented
+ */
+#define BITS_CONSTANT 0
+#define BITS_ENCODING 1
+#define BITS_REVERSED 2
+
+struct bits {
+	int source;
+	int shift;
+	int width;
+	int complement;
+	int constant;
+};
+
+struct field {
+	struct bits bits;
+	struct bits invert;
+	int check;
+};
+
+#define FIELD_DEVICE      0
+#define FIELD_SUBDEVICE   1
+#define FIELD_FUNCTION    2
+#define FIELD_SUBFUNCTION 3
+#define FIELD_REPEAT      4
+#define NFIELDS           5
+char *fieldnames[NFIELDS] = {
+	"device", "subdevice", "function", "subfunction", "repeat"
+};
+
+/*
+ * a protocol as described in the protocol file; the repeat interval is
+ * 100 milliseconds if not given; toggle tells that the repeat field is a bit
+ * flipped at each press of a key instead of a mark of a repeat
+ */
+#define DEFAULTINTERVAL 4410
+
+struct description {
+	char name[32];
+	int keyprotocol;
+	struct protocol protocol;
+	struct compiled compiled;
+	int beam;
+	int interval;
+	int toggle;
+	struct field field[NFIELDS];
+};
+
+/*
+ * the protocols, in the order they are tried
+ */
+struct description descriptions[MAXPROTOCOLS];
+int ndescriptions = 0;
+
+/*
+ * the default protocols, from protocols.conf
+ */
+char *protocols_default =
+#include "protocolsconf.h"
+;
+
+/*
+ * from encoding to key
+ */
+int bitsvalue(struct bits *bits, uint32_t encoding) {
+	uint32_t value, mask;
+
+	if (bits->source == BITS_CONSTANT)
+		return bits->constant;
+
+	value = bits->source == BITS_REVERSED ? bitreverse(encoding) : encoding;
+	mask = bits->width >= 32 ? 0xFFFFFFFF : (1U << bits->width) - 1;
+	value = (value >> bits->shift) & mask;
+	if (bits->complement)
+		value = ~value & mask;
+	return value;
+}
+
+void descriptionfield(struct description *description, uint32_t encoding,
+		int *values, int i) {
+	struct field *field;
+	uint32_t mask;
+
+	field = &description->field[i];
+	values[i] = bitsvalue(&field->bits, encoding);
+	mask = field->bits.width >= 32 ?
+		0xFFFFFFFF : (1U << field->bits.width) - 1;
+	if (bitsvalue(&field->invert, encoding))
+		values[i] = ~values[i] & mask;
+	if (field->check &&
+	    values[i - 1] == (int) (~values[i] & mask))
+		values[i] = -1;
+}
+
+void descriptionkey(struct description *description, uint32_t encoding,
+		struct key *key) {
+	int values[NFIELDS], i;
+
+	for (i = 0; i < NFIELDS; i++)
+		descriptionfield(description, encoding, values, i);
+
+	key->protocol =    description->keyprotocol;
+	key->device =      values[FIELD_DEVICE];
+	key->subdevice =   values[FIELD_SUBDEVICE];
+	key->function =    values[FIELD_FUNCTION];
+	key->subfunction = values[FIELD_SUBFUNCTION];
+	key->repeat =      values[FIELD_REPEAT];
+}
+
+/*
+ * parse the bits of a field: a number or [~](e|r)SHIFT:WIDTH
+ */
+int parsebits(struct bits *bits, char *string) {
+	char *end;
+
+	bits->complement = string[0] == '~';
+	if (bits->complement)
+		string++;
+
+	if (string[0] == 'e' || string[0] == 'r') {
+		bits->source = string[0] == 'e' ? BITS_ENCODING : BITS_REVERSED;
+		bits->shift = strtol(string + 1, &end, 10);
+		if (end == string + 1 || *end != ':')
+			return -1;
+		string = end + 1;
+		bits->width = strtol(string, &end, 10);
+		if (end == string || *end != '\0')
+			return -1;
+		if (bits->shift < 0 || bits->shift > 31 ||
+		    bits->width < 1 || bits->width > 32)
+			return -1;
+		return 0;
+	}
+
+	if (bits->complement)
+		return -1;
+	bits->source = BITS_CONSTANT;
+	bits->constant = strtol(string, &end, 0);
+	return end == string || *end != '\0' ? -1 : 0;
+}
+
+/*
+ * parse a sequence of pairs into an array ending with END
+ */
+int parsesequence(int *seq, int len, char *line) {
+	char *token, *end;
+	int pos, times;
+
+	pos = 0;
+	while ((token = strsep(&line, " \t")) != NULL) {
+		if (*token == '\0')
+			continue;
+
+		if (! strncmp(token, "BIT", 3)) {
+			times = 1;
+			if (token[3] == '*') {
+				times = strtol(token + 4, &end, 10);
+				if (end == token + 4 || *end != '\0' || times < 1)
+					return -1;
+			}
+			else if (token[3] != '\0')
+				return -1;
+			for (; times > 0; times--) {
+				if (pos + 2 >= len)
+					return -1;
+				seq[pos++] = first(BIT);
+				seq[pos++] = second(BIT);
+			}
+			continue;
+		}
+
+		if (pos + 2 >= len)
+			return -1;
+		seq[pos] = strtol(token, &end, 10);
+		if (end == token || *end != ',')
+			return -1;
+		token = end + 1;
+		seq[pos + 1] = strtol(token, &end, 10);
+		if (end == token || *end != '\0')
+			return -1;
+		if ((seq[pos] == first(END) && seq[pos + 1] == second(END)) ||
+		    (seq[pos] == first(BIT) && seq[pos + 1] == second(BIT)))
+			return -1;
+		pos += 2;
+	}
+
+	seq[pos++] = first(END);
+	seq[pos++] = second(END);
+	return 0;
+}
+
+/*
+ * parse a field of the key
+ */
+int parsefield(struct field *field, char *line) {
+	char *token;
+
+	token = strsep(&line, " \t");
+	if (token == NULL || parsebits(&field->bits, token))
+		return -1;
+
+	while ((token = strsep(&line, " \t")) != NULL) {
+		if (*token == '\0')
+			continue;
+		if (! strcmp(token, "check"))
+			field->check = 1;
+		else if (! strcmp(token, "invert")) {
+			token = strsep(&line, " \t");
+			if (token == NULL || parsebits(&field->invert, token))
+				return -1;
+		}
+		else
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * a new protocol, and the number of the protocol of its keys
+ */
+int descriptionstart(struct description *description, char *line) {
+	char *name, *keyname;
+	int i;
+
+	name = strsep(&line, " \t");
+	keyname = line == NULL || *line == '\0' ? name : line;
+	if (*name == '\0' || strlen(name) >= sizeof(description->name))
+		return -1;
+
+	memset(description, 0, sizeof(struct description));
+	strcpy(description->name, name);
+	description->interval = DEFAULTINTERVAL;
+	for (i = 0; i < NFIELDS; i++) {
+		description->field[i].bits.source = BITS_CONSTANT;
+		description->field[i].bits.constant =
+			i == FIELD_REPEAT ? 0 : -1;
+		description->field[i].invert.source = BITS_CONSTANT;
+		description->field[i].invert.constant = 0;
+	}
+
+	description->keyprotocol = protocolnumber(keyname);
+	if (description->keyprotocol == -1) {
+		if (nprotocolnames >= MAXPROTOCOLS)
+			return -1;
+		protocolnames[nprotocolnames] = strdup(keyname);
+		description->keyprotocol = nprotocolnames++;
+	}
+	return 0;
+}
+
+/*
+ * check a protocol and compile it for matching
+ */
+int descriptionend(struct description *description) {
+	int i;
+
+	if (description->protocol.max <= 0)
+		return -1;
+	if (description->protocol.main[0] == first(END) &&
+	    description->protocol.main[1] == second(END))
+		return -1;
+	for (i = 0; description->protocol.main[i] != first(END) ||
+			description->protocol.main[i + 1] != second(END);
+			i += 2)
+		if (description->protocol.main[i] == first(BIT) &&
+		    description->protocol.main[i + 1] == second(BIT) &&
+		    (description->protocol.zero[0] == first(END) ||
+		     description->protocol.one[0] == first(END)))
+			return -1;
+
+	protocol_compile(&description->compiled, &description->protocol);
+	return 0;
+}
+
+/*
+ * read the protocols from a file
+ */
+int protocols_read(FILE *in, char *filename) {
+	struct description *description;
+	char line[1000], *rest, *word;
+	int lineno, i, res;
+
+	description = NULL;
+	ndescriptions = 0;
+	while (nprotocolnames > 0)
+		free(protocolnames[--nprotocolnames]);
+	for (lineno = 1; fgets(line, sizeof(line), in) != NULL; lineno++) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '#')
+			continue;
+		rest = line + strspn(line, " \t");
+
+		if (*rest == '\0') {
+			if (description != NULL && descriptionend(description))
+				goto error;
+			description = NULL;
+			continue;
+		}
+
+		word = strsep(&rest, " \t");
+		if (rest == NULL)
+			rest = "";
+		rest += strspn(rest, " \t");
+
+		if (! strcmp(word, "protocol")) {
+			if (description != NULL && descriptionend(description))
+				goto error;
+			if (ndescriptions >= MAXPROTOCOLS)
+				goto error;
+			description = &descriptions[ndescriptions++];
+			if (descriptionstart(description, rest))
+				goto error;
+			continue;
+		}
+
+		if (description == NULL)
+			goto error;
+		if (! strcmp(word, "max"))
+			res = (description->protocol.max = atoi(rest)) <= 0;
+		else if (! strcmp(word, "beam")) {
+			description->beam = atoi(rest);
+			res = description->beam < 2 ||
+				description->beam > MAXBEAM;
+		}
+		else if (! strcmp(word, "interval"))
+			res = (description->interval = atoi(rest)) <= 0;
+		else if (! strcmp(word, "toggle")) {
+			description->toggle = 1;
+			res = *rest != '\0';
+		}
+		else if (! strcmp(word, "main"))
+			res = parsesequence(description->protocol.main,
+				100, rest);
+		else if (! strcmp(word, "zero"))
+			res = parsesequence(description->protocol.zero,
+				20, rest);
+		else if (! strcmp(word, "one"))
+			res = parsesequence(description->protocol.one,
+				20, rest);
+		else {
+			for (i = 0; i < NFIELDS; i++)
+				if (! strcmp(word, fieldnames[i]))
+					break;
+			res = i == NFIELDS ||
+				parsefield(&description->field[i], rest) ||
+				(description->field[i].check &&
+				 i != FIELD_SUBDEVICE && i != FIELD_SUBFUNCTION);
+		}
+		if (res)
+			goto error;
+	}
+
+	if (description != NULL && descriptionend(description))
+		goto error;
+	if (ndescriptions == 0) {
+		fprintf(stderr, "%s: no protocol\n", filename);
+		return -1;
+	}
+	return 0;
+
+error:
+	fprintf(stderr, "%s:%d: invalid protocol description\n",
+		filename, lineno);
+	ndescriptions = 0;
+	return -1;
+}
+
+/*
+ * load the protocols from a file, or the default ones if filename is NULL;
+ * to be called once at startup, before protocols_init() and stringtokey()
+ */
+int protocols_load(char *filename) {
+	FILE *in;
+	int res;
+
+	if (filename == NULL) {
+		in = fmemopen(protocols_default, strlen(protocols_default), "r");
+		filename = "protocols.conf";
+	}
+	else
+		in = fopen(filename, "r");
+	if (in == NULL) {
+		perror(filename);
+		return -1;
+	}
+	res = protocols_read(in, filename);
+	fclose(in);
+	return res;
 }
 
 /*
- * status of all protocols
+ * status of all protocols, each also inverted; matcher m is protocol m / 2
+ * in the order of the protocol file, inverted if m is odd, and is debugged by
+ * option -d m + 1; the state of the matchers is in parallel arrays, and so
+ * are the values that start each; the idle matchers are the ones that may be
+ * skipped, since a value out of their start ranges leaves them idle
  */
+#define MAXMATCHERS (2 * MAXPROTOCOLS)
+
 struct protocols_status {
-	struct protocol_status nec;
-	struct protocol_status necinverted;
-	struct protocol_status necrepeat;
-	struct protocol_status necrepeatinverted;
-	struct protocol_status nec2;
-	struct protocol_status nec2inverted;
-	struct protocol_status nec2repeat;
-	struct protocol_status nec2repeatinverted;
-	struct protocol_status sharp;
-	struct protocol_status sharpinverted;
-	struct protocol_status sony12;
-	struct protocol_status sony12inverted;
-	struct protocol_status sony20;
-	struct protocol_status sony20inverted;
-	struct protocol_status rc5;
-	struct protocol_status rc5inverted;
+	int startmin[MAXSTART][MAXMATCHERS];
+	int startmax[MAXSTART][MAXMATCHERS];
+	int main[MAXMATCHERS];
+	int zero[MAXMATCHERS];
+	int one[MAXMATCHERS];
+	uint32_t encoding[MAXMATCHERS];
+	long start[MAXMATCHERS];
+	double error[MAXMATCHERS];
+	int pairs[MAXMATCHERS];
+	uint32_t active;
+	struct beam beam[MAXMATCHERS];
+	long time;
+	int nmatchers;
+	int simd;
 	int debug;
+
+	/* adaptive mode: the matchers without keys in the last confidence
+	 * keys are demoted, until the start pattern of one is seen */
+	int confidence;
+	uint32_t demoted;
+	int window[MAXMATCHERS];
+	int windowkeys;
+	int previous;
+	long previousstart;
+	struct protocols_counters counters;
+
+	/* the devices the decoder is restricted to, if any, and the matchers
+	 * of the other protocols */
+	struct remotedevice devices[MAXDEVICES];
+	int ndevices;
+	uint32_t disabled;
 };
 
 /*
- * init all protocols
+ * vector kernels for the matchers that a value may start: the bit of each
+ * matcher that has the value within one of its start ranges
+ */
+#ifdef SIMD
+int protocols_simdlevel() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? 2 :
+		__builtin_cpu_supports("sse2") ? 1 : 0;
+}
+
+__attribute__((target("sse2")))
+uint32_t startmask_sse2(int value, struct protocols_status *status) {
+	__m128i v, in, out;
+	uint32_t mask;
+	int i, k;
+
+	v = _mm_set1_epi32(value);
+	mask = 0;
+	for (i = 0; i < status->nmatchers; i += 4) {
+		in = _mm_setzero_si128();
+		for (k = 0; k < MAXSTART; k++) {
+			out = _mm_or_si128(
+				_mm_cmplt_epi32(v, _mm_loadu_si128(
+					(__m128i *) &status->startmin[k][i])),
+				_mm_cmpgt_epi32(v, _mm_loadu_si128(
+					(__m128i *) &status->startmax[k][i])));
+			in = _mm_or_si128(in, _mm_andnot_si128(out,
+				_mm_set1_epi32(-1)));
+		}
+		mask |= (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(in)) << i;
+	}
+	return mask;
+}
+
+__attribute__((target("avx2")))
+uint32_t startmask_avx2(int value, struct protocols_status *status) {
+	__m256i v, in, out;
+	uint32_t mask;
+	int i, k;
+
+	v = _mm256_set1_epi32(value);
+	mask = 0;
+	for (i = 0; i < status->nmatchers; i += 8) {
+		in = _mm256_setzero_si256();
+		for (k = 0; k < MAXSTART; k++) {
+			out = _mm256_or_si256(
+				_mm256_cmpgt_epi32(_mm256_loadu_si256(
+					(__m256i *) &status->startmin[k][i]), v),
+				_mm256_cmpgt_epi32(v, _mm256_loadu_si256(
+					(__m256i *) &status->startmax[k][i])));
+			in = _mm256_or_si256(in, _mm256_andnot_si256(out,
+				_mm256_set1_epi32(-1)));
+		}
+		mask |= (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(in)) << i;
+	}
+	return mask;
+}
+#endif
+
+uint32_t startmask(int value, struct protocols_status *status) {
+	uint32_t mask;
+	int m, k;
+
+#ifdef SIMD
+	switch (status->simd) {
+	case 2:
+		return startmask_avx2(value, status);
+	case 1:
+		return startmask_sse2(value, status);
+	}
+#endif
+	mask = 0;
+	for (m = 0; m < status->nmatchers; m++)
+		for (k = 0; k < MAXSTART; k++)
+			if (status->startmin[k][m] <= value &&
+			    value <= status->startmax[k][m])
+				mask |= 1U << m;
+	return mask;
+}
+
+/*
+ * whether the decoder is restricted to no device of a protocol
+ */
+int protocoldisabled(struct protocols_status *status, int protocol) {
+	int d;
+	if (status->ndevices == 0)
+		return 0;
+	for (d = 0; d < status->ndevices; d++)
+		if (status->devices[d].protocol == protocol)
+			return 0;
+	return 1;
+}
+
+/*
+ * init all protocols; the default ones if none was loaded; if ndevices is not
+ * zero, only the protocols of the devices are run, and only the keys of the
+ * devices are returned
  */
-void *protocols_init(int debug) {
+void *protocols_init(int debug, struct remotedevice *devices, int ndevices) {
 	struct protocols_status *status;
+	struct compiled *compiled;
+	int m, k;
+
+	if (ndescriptions == 0 && protocols_load(NULL))
+		return NULL;
+
 	status = malloc(sizeof(struct protocols_status));
 	status->debug = debug;
-	protocol_init(&status->nec);
-	protocol_init(&status->necinverted);
-	protocol_init(&status->necrepeat);
-	protocol_init(&status->necrepeatinverted);
-	protocol_init(&status->nec2);
-	protocol_init(&status->nec2inverted);
-	protocol_init(&status->nec2repeat);
-	protocol_init(&status->nec2repeatinverted);
-	protocol_init(&status->sharp);
-	protocol_init(&status->sharpinverted);
-	protocol_init(&status->sony12);
-	protocol_init(&status->sony12inverted);
-	protocol_init(&status->sony20);
-	protocol_init(&status->sony20inverted);
-	protocol_init(&status->rc5);
-	protocol_init(&status->rc5inverted);
+#ifdef SIMD
+	status->simd = protocols_simdlevel();
+#endif
+	status->nmatchers = 2 * ndescriptions;
+
+	status->ndevices = ndevices > MAXDEVICES ? MAXDEVICES : ndevices;
+	if (status->ndevices > 0)
+		memcpy(status->devices, devices,
+			status->ndevices * sizeof(struct remotedevice));
+	status->disabled = 0;
+	for (m = 0; m < status->nmatchers; m++)
+		if (protocoldisabled(status, descriptions[m / 2].keyprotocol))
+			status->disabled |= 1U << m;
+
+	for (m = 0; m < MAXMATCHERS; m++) {
+		status->main[m] = 0;
+		status->zero[m] = 0;
+		status->one[m] = 0;
+		status->encoding[m] = 0;
+		status->start[m] = 0;
+		status->error[m] = 0;
+		status->pairs[m] = 0;
+		memset(&status->beam[m], 0, sizeof(struct beam));
+
+		/* an inverted matcher sees -value: start ranges are mirrored */
+		compiled = &descriptions[m / 2].compiled;
+		for (k = 0; k < MAXSTART; k++) {
+			if (m >= status->nmatchers || k >= compiled->nstart ||
+			    (status->disabled & (1U << m))) {
+				status->startmin[k][m] = 1;
+				status->startmax[k][m] = 0;
+			}
+			else if (m % 2 == 0) {
+				status->startmin[k][m] = compiled->startmin[k];
+				status->startmax[k][m] = compiled->startmax[k];
+			}
+			else {
+				status->startmin[k][m] = -compiled->startmax[k];
+				status->startmax[k][m] = -compiled->startmin[k];
+			}
+		}
+	}
+	status->active = 0;
+	status->time = 0;
+
+	status->confidence = 0;
+	status->demoted = 0;
+	memset(status->window, 0, sizeof(status->window));
+	status->windowkeys = 0;
+	status->previous = 0;
+	status->previousstart = 0;
+	memset(&status->counters, 0, sizeof(struct protocols_counters));
 	return status;
 }
 
 /*
- * from protocol to key
+ * whether the key of an encoding is of a device the decoder is restricted
+ * to; all are if the decoder is not restricted, and a key without a device,
+ * like a repeat code, is of any device of its protocol
  */
-#define PROTOCOL_KEY(protocol, protocolstatus, status, conversion)	\
-	res = protocol_value_return(value,				\
-		& protocol ## _protocol,				\
-		&status->protocolstatus,				\
-		status->debug == protocol ## _debug);			\
-	if (res)							\
-		return conversion(status->protocolstatus.encoding);	\
-	res = protocol_value_return(-value,				\
-		& protocol ## _protocol,				\
-		&status->protocolstatus ## inverted,			\
-		status->debug == protocol ## inverted_debug);		\
-	if (res) 							\
-		return conversion(status->protocolstatus ## inverted.encoding);
+int deviceallowed(struct protocols_status *status,
+		struct description *description, uint32_t encoding) {
+	int values[NFIELDS], d;
+	struct remotedevice *device;
+
+	if (status->ndevices == 0)
+		return 1;
+
+	descriptionfield(description, encoding, values, FIELD_DEVICE);
+	if (values[FIELD_DEVICE] == -1)
+		return 1;
+	descriptionfield(description, encoding, values, FIELD_SUBDEVICE);
+
+	for (d = 0; d < status->ndevices; d++) {
+		device = &status->devices[d];
+		if (device->protocol != description->keyprotocol)
+			continue;
+		if (device->device == -1)
+			return 1;
+		if (device->device == values[FIELD_DEVICE] &&
+		    device->subdevice == values[FIELD_SUBDEVICE])
+			return 1;
+	}
+	return 0;
+}
 
 /*
- * parse a value according to a protocol or inverse protocol
+ * the event of a key completed by a matcher
  */
-struct key *protocols_value(int value, void *internal) {
-	struct protocols_status *status;
+void matcherevent(struct description *description,
+		struct protocol_status *matcher, long end,
+		struct keyevent *event) {
+	descriptionkey(description, matcher->encoding, &event->key);
+	event->start = matcher->start;
+	event->end = end;
+	event->error = matcher->pairs == 0 ? 0 : matcher->error / matcher->pairs;
+	event->interval = description->interval;
+	event->toggle = description->toggle;
+}
+
+/*
+ * run a value through a matcher, on its state gathered from the arrays;
+ * fresh tells whether the value may start the protocol
+ */
+int matcher_value(struct protocols_status *status, int m,
+		int value, long start, int fresh, struct protocol_status *matcher) {
+	struct description *description;
 	int res;
 
+	description = &descriptions[m / 2];
+	value = m % 2 ? -value : value;
+	status->counters.runs++;
+
+	if (description->beam > 0) {
+		res = beam_value(value, start,
+			&description->compiled, description->beam,
+			&status->beam[m], fresh, matcher,
+			status->debug == m + 1);
+		if (status->beam[m].n > 0)
+			status->active |= 1U << m;
+		else
+			status->active &= ~(1U << m);
+		return res;
+	}
+
+	matcher->main = status->main[m];
+	matcher->zero = status->zero[m];
+	matcher->one = status->one[m];
+	matcher->encoding = status->encoding[m];
+	matcher->start = status->start[m];
+	matcher->error = status->error[m];
+	matcher->pairs = status->pairs[m];
+
+	if (status->debug == m + 1) {
+		if (! (status->active & (1U << m)))
+			matcher->start = start;
+		res = protocol_value_return(value,
+			&description->protocol, matcher, 1);
+	}
+	else
+		res = compiled_value(value, start,
+			&description->compiled, matcher);
+
+	status->main[m] = matcher->main;
+	status->zero[m] = matcher->zero;
+	status->one[m] = matcher->one;
+	status->encoding[m] = matcher->encoding;
+	status->start[m] = matcher->start;
+	status->error[m] = matcher->error;
+	status->pairs[m] = matcher->pairs;
+	if (matcher->main == 0 && matcher->zero == 0 && matcher->one == 0)
+		status->active &= ~(1U << m);
+	else
+		status->active |= 1U << m;
+	return res;
+}
+
+/*
+ * adaptive mode: account a key; once enough keys are found, demote the
+ * matchers that found none of them
+ */
+void adaptivekey(struct protocols_status *status, int m) {
+	int i;
+
+	status->counters.completed[m]++;
+	if (status->confidence == 0 || status->demoted)
+		return;
+
+	status->window[m]++;
+	status->windowkeys++;
+	if (status->windowkeys < status->confidence)
+		return;
+
+	for (i = 0; i < status->nmatchers; i++)
+		if (status->window[i] == 0 && status->debug != i + 1 &&
+		    ! (status->disabled & (1U << i))) {
+			status->demoted |= 1U << i;
+			status->main[i] = 0;
+			status->zero[i] = 0;
+			status->one[i] = 0;
+			status->beam[i].n = 0;
+		}
+	status->active &= ~status->demoted;
+	status->counters.demotions++;
+}
+
+/*
+ * adaptive mode: restore all matchers if the previous and the current value
+ * are the start pattern of a demoted one; the matchers that recognize the
+ * start pattern are given the previous value, so that they do not miss the
+ * key that is starting
+ */
+void adaptiverestore(struct protocols_status *status, int value) {
+	struct protocol_status matcher;
+	uint32_t restored;
+	int m;
+
+	restored = 0;
+	for (m = 0; m < status->nmatchers; m++)
+		if ((status->demoted & (1U << m)) &&
+		    protocol_pattern(&descriptions[m / 2].compiled,
+				m % 2 ? -status->previous : status->previous,
+				m % 2 ? -value : value))
+			restored |= 1U << m;
+	if (! restored)
+		return;
+
+	status->demoted = 0;
+	memset(status->window, 0, sizeof(status->window));
+	status->windowkeys = 0;
+	status->counters.restores++;
+
+	for (m = 0; m < status->nmatchers; m++)
+		if (restored & (1U << m))
+			matcher_value(status, m, status->previous,
+				status->previousstart, 1, &matcher);
+}
+
+/*
+ * parse a value according to a protocol or inverse protocol; only the
+ * matchers in the middle of a sequence and the ones the value may start are
+ * run; end is the last sample of the value; the decoded key is stored in the
+ * caller's struct, and 1 returned when there is one
+ */
+int protocols_event(int value, long end, void *internal,
+		struct keyevent *event) {
+	struct protocols_status *status;
+	struct protocol_status matcher;
+	uint32_t fresh, mask;
+	long start;
+	int m, res;
+
+	status = (struct protocols_status *) internal;
+	start = end - abs(value) + 1;
+	status->counters.values++;
+
+	if (status->demoted)
+		adaptiverestore(status, value);
+
+	fresh = startmask(value, status);
+	mask = status->active | fresh;
+	if (status->debug > 0 && status->debug <= status->nmatchers)
+		mask |= 1U << (status->debug - 1);
+	mask &= ~status->disabled;
+	if (status->demoted) {
+		status->counters.skipped +=
+			__builtin_popcount(mask & status->demoted);
+		mask &= ~status->demoted;
+	}
+	status->previous = value;
+	status->previousstart = start;
+
+	for (m = 0; m < status->nmatchers; m++) {
+		if (! (mask & (1U << m)))
+			continue;
+		res = matcher_value(status, m, value, start,
+			(fresh >> m) & 1, &matcher);
+		if (res && ! deviceallowed(status, &descriptions[m / 2],
+				matcher.encoding)) {
+			status->counters.rejected++;
+			continue;
+		}
+		if (res) {
+			matcherevent(&descriptions[m / 2], &matcher, end,
+				event);
+			adaptivekey(status, m);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * adaptive mode: demote the matchers with no key in the last confidence
+ * keys; 0 disables
+ */
+void protocols_adaptive(void *internal, int confidence) {
+	struct protocols_status *status;
+	status = (struct protocols_status *) internal;
+	status->confidence = confidence;
+	status->demoted = 0;
+	memset(status->window, 0, sizeof(status->window));
+	status->windowkeys = 0;
+}
+
+/*
+ * counters of values, matchers run and skipped, keys per matcher
+ */
+void protocols_counters(void *internal, struct protocols_counters *counters) {
+	struct protocols_status *status;
+	status = (struct protocols_status *) internal;
+	*counters = status->counters;
+	counters->demoted = status->demoted;
+}
+
+/*
+ * print the counters, with the matchers in the numbering of -d
+ */
+void printcounters(FILE *out, struct protocols_counters *counters) {
+	int m;
+
+	fprintf(out, "values: %ld\n", counters->values);
+	fprintf(out, "matchers run: %ld\n", counters->runs);
+	fprintf(out, "matchers skipped: %ld\n", counters->skipped);
+	fprintf(out, "keys rejected: %ld\n", counters->rejected);
+	fprintf(out, "demotions: %d\n", counters->demotions);
+	fprintf(out, "restores: %d\n", counters->restores);
+	for (m = 0; m < 2 * ndescriptions; m++)
+		fprintf(out, "%2d %-12s %s %6ld%s\n", m + 1,
+			descriptions[m / 2].name, m % 2 ? "inverse" : "direct ",
+			counters->completed[m],
+			counters->demoted & (1U << m) ? " demoted" : "");
+}
+
+/*
+ * same, with the samples counted from the first value; only the key
+ */
+int protocols_key(int value, void *internal, struct key *key) {
+	struct protocols_status *status;
+	struct keyevent event;
+
 	status = (struct protocols_status *) internal;
+	status->time += abs(value);
+	if (! protocols_event(value, status->time - 1, internal, &event))
+		return 0;
+	*key = event.key;
+	return 1;
+}
 
-	PROTOCOL_KEY(nec, nec, status, neckey)
-	PROTOCOL_KEY(necrepeat, necrepeat, status, necrepeatkey)
-	PROTOCOL_KEY(nec2, nec2, status, nec2key)
-	PROTOCOL_KEY(nec2repeat, nec2repeat, status, nec2repeatkey)
-	PROTOCOL_KEY(sharp, sharp, status, sharpkey)
-	PROTOCOL_KEY(sony12, sony12, status, sony12key)
-	PROTOCOL_KEY(sony20, sony20, status, sony20key)
-	PROTOCOL_KEY(rc5, rc5, status, rc5key)
+/*
+ * the first sample where a key not decoded yet may start, given the last
+ * sample of the input: the start of a key some matcher is following, or of
+ * the value still counted by the runlength filter if it is short enough to
+ * begin a key
+ */
+long protocols_pending(void *internal, long now) {
+	struct protocols_status *status;
+	struct beam *beam;
+	long earliest, next;
+	int m, h, d;
+
+	status = (struct protocols_status *) internal;
+	earliest = now;
+	for (m = 0; m < status->nmatchers; m++) {
+		if (! (status->active & (1U << m)))
+			continue;
+		if (descriptions[m / 2].beam > 0) {
+			beam = &status->beam[m];
+			for (h = 0; h < beam->n; h++)
+				if (beam->hypothesis[h].start < earliest)
+					earliest = beam->hypothesis[h].start;
+		}
+		else if (status->start[m] < earliest)
+			earliest = status->start[m];
+	}
 
-	return NULL;
+	next = status->previousstart + abs(status->previous);
+	for (d = 0; d < ndescriptions; d++)
+		if (now - next < descriptions[d].protocol.max && next < earliest)
+			earliest = next;
+	return earliest;
+}
+
+/*
+ * same, returning the key in allocated memory or NULL
+ */
+struct key *protocols_value(int value, void *internal) {
+	struct key decoded, *key;
+
+	if (! protocols_key(value, internal, &decoded))
+		return NULL;
+	key = malloc(sizeof(struct key));
+	*key = decoded;
+	return key;
+}
+
+/*
+ * the protocols run by interpreting their arrays, as before they were
+ * compiled, for comparison only; status is an array of 2 * MAXPROTOCOLS
+ * statuses, each initialized by protocol_init(); return whether a protocol
+ * or its inverse completes a key at the value
+ */
+int protocols_interpreted(int value, struct protocol_status *status) {
+	int m;
+
+	if (ndescriptions == 0 && protocols_load(NULL))
+		return 0;
+	for (m = 0; m < 2 * ndescriptions; m++)
+		if (protocol_value_return(m % 2 == 0 ? value : -value,
+				&descriptions[m / 2].protocol, &status[m], 0))
+			return 1;
+	return 0;
 }
 
 /*
  * finish parsing all protocols
  */
 int protocols_end(void *internal) {
+	struct protocols_status *status;
+	struct beam *beam;
+
+	status = (struct protocols_status *) internal;
+	if (status->debug > 0 && status->debug <= status->nmatchers &&
+	    descriptions[(status->debug - 1) / 2].beam > 0) {
+		beam = &status->beam[status->debug - 1];
+		printf("beam: %ld values, %g steps per value, at most %d\n",
+			beam->values,
+			beam->values == 0 ? 0 : (double) beam->steps / beam->values,
+			beam->maxsteps);
+	}
 	free(internal);
 	return 0;
 }
 
+/*
+ * state of the keys: press, hold and release from the key events
+ *
+ * a key is held while its frames or the repeat codes of its protocol start
+ * at most a repeat interval and a quarter after the start of the previous;
+ * the interval is the one of the protocol until some repeats are received,
+ * then their average spacing; in a protocol with a toggle, a frame with the
+ * toggle flipped is a new press; the release is detected from the sample number
+ * given by keystate_time() or by the next event, but is placed at the
+ * deadline of the missing repeat, which that sample may be past by up to a
+ * block of input
+ */
+struct keystate {
+	int held;
+	struct key key;
+	long start, end;
+	int repeats;
+	int interval;
+	int toggle;	/* of the frame that pressed the key, -1 if none */
+	long cadence[MAXPROTOCOLS];
+};
+
+void *keystate_init() {
+	struct keystate *keystate;
+	keystate = malloc(sizeof(struct keystate));
+	memset(keystate, 0, sizeof(struct keystate));
+	return keystate;
+}
+
+void keyaction(struct keystate *keystate, int type, long sample,
+		struct keyaction *action) {
+	action->type = type;
+	action->key = keystate->key;
+	action->sample = sample;
+	action->repeats = keystate->repeats;
+	action->cadence = keystate->cadence[keystate->key.protocol];
+}
+
+/*
+ * the last sample where the next repeat of the held key may start
+ */
+long keydeadline(struct keystate *keystate) {
+	long expected;
+
+	expected = keystate->cadence[keystate->key.protocol];
+	if (expected == 0)
+		expected = keystate->interval;
+	return keystate->start + expected + expected / 4;
+}
+
+/*
+ * the time is sample now: release the key if its repeats are late
+ */
+int keystate_time(void *internal, long now, struct keyaction *action) {
+	struct keystate *keystate;
+	long deadline;
+
+	keystate = (struct keystate *) internal;
+	if (! keystate->held)
+		return 0;
+
+	deadline = keydeadline(keystate);
+	if (now <= deadline)
+		return 0;
+
+	keyaction(keystate, KEY_RELEASE, deadline, action);
+	keystate->held = 0;
+	return 1;
+}
+
+/*
+ * a key event: store the resulting actions, at most two, and return their
+ * number; a repeat code with no key held is ignored
+ */
+int keystate_event(void *internal, struct keyevent *event,
+		struct keyaction *actions) {
+	struct keystate *keystate;
+	struct key *key;
+	long *cadence, spacing;
+	int n, bare;
+
+	keystate = (struct keystate *) internal;
+	key = &event->key;
+	bare = ! event->toggle && key->repeat &&
+		key->device == -1 && key->function == -1;
+	n = keystate_time(internal, event->start, &actions[0]);
+
+	if (keystate->held && key->protocol == keystate->key.protocol &&
+	    (bare || keyequal(key, &keystate->key, 0)) &&
+	    (! event->toggle || key->repeat == keystate->toggle)) {
+		cadence = &keystate->cadence[key->protocol];
+		spacing = event->start - keystate->start;
+		*cadence = *cadence == 0 ? spacing : (3 * *cadence + spacing) / 4;
+		keystate->start = event->start;
+		keystate->end = event->end;
+		keystate->repeats++;
+		keyaction(keystate, KEY_HOLD, event->end, &actions[n++]);
+		return n;
+	}
+
+	if (keystate->held) {
+		keyaction(keystate, KEY_RELEASE, event->start, &actions[n++]);
+		keystate->held = 0;
+	}
+	if (bare || key->protocol < 0)
+		return n;
+
+	keystate->held = 1;
+	keystate->key = *key;
+	keystate->key.repeat = 0;
+	keystate->toggle = event->toggle ? key->repeat : -1;
+	keystate->start = event->start;
+	keystate->end = event->end;
+	keystate->repeats = 0;
+	keystate->interval = event->interval;
+	keyaction(keystate, KEY_PRESS, event->end, &actions[n++]);
+	return n;
+}
+
+/*
+ * end of input: release the key if held
+ */
+int keystate_end(void *internal, long now, struct keyaction *action) {
+	struct keystate *keystate;
+	long deadline;
+	int n;
+
+	keystate = (struct keystate *) internal;
+	n = 0;
+	if (keystate->held) {
+		deadline = keydeadline(keystate);
+		keyaction(keystate, KEY_RELEASE,
+			now < deadline ? now : deadline, action);
+		n = 1;
+	}
+	free(internal);
+	return n;
+}
+
+/*
+ * print a key action: type, sample, key, repeats and their spacing
+ */
+void printaction(FILE *out, struct keyaction *action) {
+	char *string;
+	string = keytostring(&action->key, ',', '-');
+	fprintf(out, "%s %ld %s %d %ld\n",
+		action->type == KEY_PRESS ? "press" :
+		action->type == KEY_HOLD ? "hold" : "release",
+		action->sample, string, action->repeats, action->cadence);
+	free(string);
+}
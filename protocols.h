@@ -37,6 +37,9 @@ struct protocol_status {
 	int zero;
 	int one;
 	uint32_t encoding;
+	long start;	/* first sample of the sequence, if known */
+	double error;	/* sum of the deviations of the values within pairs */
+	int pairs;	/* number of them */
 };
 
 /*
@@ -57,93 +60,6 @@ int protocol_value(int value,
 		struct protocol *protocol, struct protocol_status *status,
 		int debug, void callback(uint32_t encoding));
 
-/*
- * status variables for a protocol
- */
-#define PROTOCOL_VARS(protocol)						\
-	struct protocol_status protocol ## _status;			\
-	struct protocol_status protocol ## inverted_status;
-
-/*
- * initialize a protocol and its inverse
- */
-#define PROTOCOL_START(protocol)					\
-	protocol_init(& protocol ## _status);				\
-	protocol_init(& protocol ## inverted_status);
-
-/*
- * process a value and its inverse according to a protocol
- */
-#define PROTOCOL_PROCESS(value, protocol)				\
-	protocol_value(value,						\
-		& protocol ## _protocol,				\
-		& protocol ## _status,					\
-		debug == protocol ## _debug,				\
-		protocol ## _print);					\
-	if (inversion)							\
-		protocol_value(-value,					\
-			& protocol ## _protocol,			\
-			& protocol ## inverted_status,			\
-			debug == protocol ## inverted_debug,		\
-			protocol ## _print);
-
-
-/*
- * values for debugging each protocol and its inversion
- */
-enum protocol_debug {
-	nec_debug = 1,
-	necinverted_debug,
-	necrepeat_debug,
-	necrepeatinverted_debug,
-	nec2_debug,
-	nec2inverted_debug,
-	nec2repeat_debug,
-	nec2repeatinverted_debug,
-	sharp_debug,
-	sharpinverted_debug,
-	sony12_debug,
-	sony12inverted_debug,
-	sony20_debug,
-	sony20inverted_debug,
-	rc5_debug,
-	rc5inverted_debug,
-};
-
-/*
- * the protocols
- */
-enum protocols {
-	nec,
-	necrepeat,
-	nec2,
-	nec2repeat,
-	sharp,
-	sony12,
-	sony20,
-	rc5,
-};
-extern struct protocol nec_protocol;
-extern struct protocol necrepeat_protocol;
-extern struct protocol nec2_protocol;
-extern struct protocol nec2repeat_protocol;
-extern struct protocol sharp_protocol;
-extern struct protocol sony12_protocol;
-extern struct protocol sony20_protocol;
-extern struct protocol rc5_protocol;
-
-/*
- * print the encoding for each protocol
- */
-void nec_print(uint32_t encoding);
-void nec2_print(uint32_t encoding);
-void necrepeat_print(uint32_t encoding);
-void nec2repeat_print(uint32_t encoding);
-void sharp_print(uint32_t encoding);
-void sony12_print(uint32_t encoding);
-void sony20_print(uint32_t encoding);
-void rc5_print(uint32_t encoding);
-
 /*
  * a key
  */
@@ -163,9 +79,85 @@ void printkey(struct key *key);
 int keyequal(struct key *a, struct key *b, int comparerepeat);
 
 /*
- * parse all protocols and their inverse at the same time
+ * a key as decoded: first sample of the key, last sample of the value that
+ * completed it, mean relative deviation of its values from the middle of
+ * their ranges in the protocol
+ */
+struct keyevent {
+	struct key key;
+	long start;
+	long end;
+	double error;
+	int interval;	/* nominal repeat interval of the protocol */
+	int toggle;	/* repeat is a bit flipped at each press */
+};
+void printevent(FILE *out, struct keyevent *event);
+
+/*
+ * parse all protocols and their inverse at the same time; the protocols are
+ * the default ones or the ones loaded from a file at startup
  */
-void *protocols_init(int debug);
+#define MAXPROTOCOLS 16
+int protocols_load(char *filename);
+uint32_t protocols_hash();
+
+/*
+ * a device of a remote, as printed by layout -c: protocol,device-subdevice;
+ * a decoder restricted to some devices only runs the protocols of them, and
+ * drops the keys of other devices; device -1 is any device of the protocol
+ */
+#define MAXDEVICES 256
+struct remotedevice {
+	int protocol;
+	int device;
+	int subdevice;
+};
+int stringtodevice(char *string, struct remotedevice *device);
+
+void *protocols_init(int debug, struct remotedevice *devices, int ndevices);
+int protocols_key(int value, void *internal, struct key *key);
+int protocols_event(int value, long end, void *internal,
+		struct keyevent *event);
 struct key *protocols_value(int value, void *internal);
+long protocols_pending(void *internal, long now);
 int protocols_end(void *internal);
+int protocols_interpreted(int value, struct protocol_status *status);
+
+/*
+ * adaptive mode and its counters: runs and skipped are the values passed or
+ * not passed to a matcher because it was demoted; rejected are the keys of
+ * devices the decoder is not restricted to
+ */
+struct protocols_counters {
+	long values;
+	long runs;
+	long skipped;
+	long rejected;
+	int demotions;
+	int restores;
+	uint32_t demoted;
+	long completed[2 * MAXPROTOCOLS];
+};
+void protocols_adaptive(void *internal, int confidence);
+void protocols_counters(void *internal, struct protocols_counters *counters);
+void printcounters(FILE *out, struct protocols_counters *counters);
 
+/*
+ * press, hold and release of keys from their events
+ */
+#define KEY_PRESS   1
+#define KEY_HOLD    2
+#define KEY_RELEASE 3
+struct keyaction {
+	int type;
+	struct key key;
+	long sample;
+	int repeats;
+	long cadence;	/* measured repeat interval, 0 if not yet */
+};
+void *keystate_init();
+int keystate_event(void *internal, struct keyevent *event,
+		struct keyaction *actions);
+int keystate_time(void *internal, long now, struct keyaction *action);
+int keystate_end(void *internal, long now, struct keyaction *action);
+void printaction(FILE *out, struct keyaction *action);
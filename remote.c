@@ -20,12 +20,51 @@
 /*
  * parse audio data as a remote protocol
  *
- * remote [-f] [-l] [-i] [-d n] (file|dev) -- [amplify_factor [trigger_bound]]
+ * remote [-f] [-l] [-i] [-b] [-d n] [-p file] [-e file] [-s] [-a n]
+ *	[-w device]... [-R n] [-S sizes] (file|dev) -- [amplify_factor [trigger_bound]]
+ * remote [-f] [-b] [-w device]... [-j n] -B (dir|list) --
+ *	[amplify_factor [trigger_bound]]
+ * remote [-f] [-b] [-w device]... -P n file --
+ *	[amplify_factor [trigger_bound]]
+ * remote [-c] [-b] [-e file] [-a n] [-w device]... [-R n] [-S sizes]
+ *	-M dev [-M dev]... -- [amplify_factor [trigger_bound]]
  *	-f	input is a sequence of numbers in ascii, one per line,
  *		instead of an AU file
  *	-c	allow receiving the output of irblast
+ *	-b	use the best sequence of filters, like layout does;
+ *		amplify_factor and trigger_bound are ignored
  *	-l	log input to log.au or log.txt
  *	-d n	debug protocol n, from 1 to 14 so far
+ *	-p file	read the protocols from file
+ *	-e file	write each key to file with its first and last sample and
+ *		its timing error
+ *	-s	print the press, hold and release of keys instead of the
+ *		keys
+ *	-a n	after n keys, only check the start of the protocols that
+ *		found none of them; check all again when the start of
+ *		one of them is seen; print the counters at the end
+ *	-w device
+ *		only decode the keys of device, as printed by layout -c:
+ *		protocol,device-subdevice, or just protocol for all its
+ *		devices; can be given multiple times
+ *	-R n	read the audio device in a thread of real-time priority n;
+ *		the thread counters are printed at the end anyway
+ *	-S sizes
+ *		period,buffer,read: frames in a period and in the buffer of
+ *		the audio device, and frames read at time; 0 is the default;
+ *		"low" is the low-latency preset
+ *	-B	decode all files in directory dir, or all files listed in
+ *		file list, one per line; print the keys of each file in
+ *		order, each with the file name and its sample offset
+ *	-j n	number of files decoded in parallel with -B; default is
+ *		the number of processors
+ *	-P n	split file in n chunks and decode them in parallel; the
+ *		output is the same as with -B
+ *	-M dev	decode audio device dev concurrently with the others given
+ *		by -M, each by its own thread, filters and protocols; print
+ *		the keys of all, each with the device name and its sample
+ *		offset; print the counters of each device at the end of all
+ *		inputs or at SIGINT
  *	amplify_factor
  *		-1 to invert, default 1
  *	trigger_bound
@@ -34,13 +73,24 @@
  *		and derives the bound from it
  *	file|dev
  *		input is read from file if it exists, otherwise from audio
- *		device dev (list available: arecord -L)
+ *		device dev (list available: arecord -L); dev file:name is a
+ *		file of raw 16-bit samples read as if it were a soundcard;
+ *		it may also be a fifo, read as the samples come
  */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
 #include "microphone.h"
 #include "filters.h"
 #include "protocols.h"
@@ -49,34 +99,722 @@
  * filter debugging: stop the chain of filters at some point and print
  */
 #define STOPHERE				\
-	printf("%d\n", value);			\
-	if (status.flush)			\
+	for (i = 0; i < n; i++)			\
+		printf("%d\n", values[i]);	\
+	if (status->flush)			\
 		fflush(stdout);			\
-	continue;
+	return 0;
+
+/*
+ * the chain of filters from the input values to their runlength encoding
+ */
+struct chain {
+	int valleyfilter;
+	int bound;
+	void *log, *valley, *diff, *amplify, *maximal, *stabilize;
+	void *background, *trigger, *runlength, *best;
+	long input;
+	long encoded;
+	long time;
+};
+
+struct chain *chaininit(char *logfile, int ascii, int valleyfilter,
+		int bestfilters, double factor, int bound,
+		struct status *status) {
+	struct chain *chain;
+
+	chain = malloc(sizeof(struct chain));
+	chain->valleyfilter = valleyfilter;
+	chain->bound = bound;
+
+	chain->log =               log_init(bestfilters ? NULL : logfile,
+						ascii, status);
+	chain->valley =         valley_init(10, status);
+	chain->diff =             diff_init(status);
+	chain->amplify =       amplify_init(factor, status);
+	chain->maximal =       maximal_init(11, status);
+	chain->stabilize =   stabilize_init(status);
+	chain->trigger =       trigger_init(bound, status);
+	chain->background = background_init(status);
+	chain->runlength =   runlength_init(status);
+	chain->best = bestfilters ? fastbest_init(logfile, status) : NULL;
+
+	chain->input = 0;
+	chain->encoded = 0;
+	chain->time = 0;
+	return chain;
+}
+
+/*
+ * process a block of input values, leaving their runlength encoding in it;
+ * return the number of runlength values
+ */
+int chainblock(struct chain *chain, int *values, int n,
+		struct status *status) {
+
+	// filter testing: STOPHERE to cut the pipe of filters short
+
+	chain->input += n;
+	if (chain->best) {
+		chain->encoded += n;
+		FILTER_BLOCK(fastbest, values, n, chain->best, status)
+		return n;
+	}
+
+	FILTER_BLOCK(log, values, n, chain->log, status)
+	if (chain->valleyfilter)
+		FILTER_BLOCK(valley, values, n, chain->valley, status)
+	FILTER_BLOCK(diff, values, n, chain->diff, status)
+	FILTER_BLOCK(amplify, values, n, chain->amplify, status)
+	FILTER_BLOCK(stabilize, values, n, chain->stabilize, status)
+	FILTER_BLOCK(maximal, values, n, chain->maximal, status)
+	if (chain->bound == -1)
+		FILTER_BLOCK(background, values, n, chain->background, status)
+	else
+		FILTER_BLOCK(trigger, values, n, chain->trigger, status)
+	chain->encoded += n;
+	FILTER_BLOCK(runlength, values, n, chain->runlength, status)
+	return n;
+}
+
+/*
+ * sample offset of the end of a runlength value, to be called on each of
+ * them in order; runlength counts all values it receives, and the filters
+ * before it only drop values at the start (diff, background) and delay the
+ * others by half the maximal window
+ */
+long chainoffset(struct chain *chain, int value) {
+	chain->time += abs(value);
+	return chain->time - 1 + chain->input - chain->encoded - 11 / 2;
+}
+
+int chainend(struct chain *chain, struct status *status) {
+	int value;
+
+	log_end(chain->log, status);
+	valley_end(chain->valley, status);
+	diff_end(chain->diff, status);
+	amplify_end(chain->amplify, status);
+	stabilize_end(chain->stabilize, status);
+	maximal_end(chain->maximal, status);
+	trigger_end(chain->trigger, status);
+	background_end(chain->background, status);
+	value = runlength_end(chain->runlength, status);
+	if (chain->best)
+		value = fastbest_end(chain->best, status);
+
+	free(chain);
+	return value;
+}
+
+/*
+ * batch decoding: the files are decoded in parallel, each by a thread with
+ * its own chain of filters and protocols; the output of each is kept in
+ * memory until all previous files are printed
+ */
+struct batchfile {
+	char *name;
+	char *output;
+	size_t size;
+	long samples;
+	int done;
+};
+
+struct batch {
+	struct batchfile *file;
+	int num;
+	int next;
+	int ascii, valleyfilter, bestfilters, bound;
+	double factor;
+	struct remotedevice devices[MAXDEVICES];
+	int ndevices;
+	pthread_mutex_t mutex;
+	pthread_cond_t done;
+};
+
+/*
+ * list of files: the regular files in a directory, or the lines of a file
+ */
+int namecompare(const void *a, const void *b) {
+	return strcmp(((struct batchfile *) a)->name,
+	              ((struct batchfile *) b)->name);
+}
+
+int batchlist(struct batch *batch, char *source) {
+	DIR *dir;
+	struct dirent *entry;
+	struct stat st;
+	FILE *list;
+	char line[4096], *name;
+	int size;
+
+	batch->file = NULL;
+	batch->num = 0;
+	size = 0;
+
+	dir = opendir(source);
+	list = dir != NULL ? NULL :
+		! strcmp(source, "-") ? stdin : fopen(source, "r");
+	if (dir == NULL && list == NULL) {
+		perror(source);
+		return -1;
+	}
+
+	while (1) {
+		if (dir) {
+			entry = readdir(dir);
+			if (entry == NULL)
+				break;
+			if (entry->d_name[0] == '.')
+				continue;
+			name = malloc(strlen(source) + 1 +
+				strlen(entry->d_name) + 1);
+			sprintf(name, "%s/%s", source, entry->d_name);
+			if (stat(name, &st) == -1 || ! S_ISREG(st.st_mode)) {
+				free(name);
+				continue;
+			}
+		}
+		else {
+			if (fgets(line, sizeof(line), list) == NULL)
+				break;
+			line[strcspn(line, "\n")] = '\0';
+			if (line[0] == '\0')
+				continue;
+			name = strdup(line);
+		}
+
+		if (batch->num >= size) {
+			size += 100;
+			batch->file = realloc(batch->file,
+				size * sizeof(struct batchfile));
+		}
+		batch->file[batch->num].name = name;
+		batch->file[batch->num].output = NULL;
+		batch->file[batch->num].size = 0;
+		batch->file[batch->num].samples = 0;
+		batch->file[batch->num].done = 0;
+		batch->num++;
+	}
+
+	if (dir) {
+		closedir(dir);
+		qsort(batch->file, batch->num, sizeof(struct batchfile),
+			namecompare);
+	}
+	else if (list != stdin)
+		fclose(list);
+	return 0;
+}
+
+/*
+ * decode a file of the batch
+ */
+void batchkey(FILE *out, char *name, long offset, int value,
+		void *protocols_status) {
+	struct key key;
+	char *string;
+
+	if (! protocols_key(value, protocols_status, &key))
+		return;
+	string = keytostring(&key, ' ', '-');
+	fprintf(out, "%s %ld %s\n", name, offset, string);
+	free(string);
+}
+
+void batchdecode(struct batch *batch, struct batchfile *file) {
+	FILE *out;
+	struct status status;
+	void *read, *protocols_status;
+	struct chain *chain;
+	int values[BLOCKSIZE], n, i;
+	long offset;
+
+	out = open_memstream(&file->output, &file->size);
+
+	read = read_init(file->name, batch->ascii, &status);
+	if (read == NULL) {
+		fprintf(out, "%s: cannot open\n", file->name);
+		fclose(out);
+		return;
+	}
+	chain = chaininit(NULL, batch->ascii, batch->valleyfilter,
+		batch->bestfilters, batch->factor, batch->bound, &status);
+	protocols_status = protocols_init(0, batch->devices,
+		batch->ndevices);
+
+	while (! status.ended) {
+		n = BLOCKSIZE;
+		FILTER_BLOCK(read, values, n, read, &status)
+		n = chainblock(chain, values, n, &status);
+		for (i = 0; i < n; i++)
+			batchkey(out, file->name, chainoffset(chain, values[i]),
+				values[i], protocols_status);
+	}
+
+	/* the last runlength value ends with the input */
+	file->samples = chain->input;
+	offset = chain->input - 1;
+	batchkey(out, file->name, offset, chainend(chain, &status),
+		protocols_status);
+
+	read_end(read, &status);
+	protocols_end(protocols_status);
+	fclose(out);
+}
+
+/*
+ * worker thread: decode the next file until none is left
+ */
+void *batchworker(void *arg) {
+	struct batch *batch;
+	int current;
+
+	batch = (struct batch *) arg;
+
+	while (1) {
+		pthread_mutex_lock(&batch->mutex);
+		current = batch->next++;
+		pthread_mutex_unlock(&batch->mutex);
+		if (current >= batch->num)
+			break;
+
+		batchdecode(batch, &batch->file[current]);
+
+		pthread_mutex_lock(&batch->mutex);
+		batch->file[current].done = 1;
+		pthread_cond_broadcast(&batch->done);
+		pthread_mutex_unlock(&batch->mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * decode a batch of files, printing their keys in order
+ */
+int batchrun(struct batch *batch, int workers) {
+	pthread_t *thread;
+	struct timespec start, end;
+	double elapsed;
+	long samples;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	batch->next = 0;
+	pthread_mutex_init(&batch->mutex, NULL);
+	pthread_cond_init(&batch->done, NULL);
+	thread = malloc(workers * sizeof(pthread_t));
+	for (i = 0; i < workers; i++)
+		if (pthread_create(&thread[i], NULL, batchworker, batch)) {
+			fprintf(stderr, "cannot start worker %d\n", i);
+			break;
+		}
+	workers = i;
+	if (workers == 0)		/* no thread: decode all here */
+		batchworker(batch);
+
+	samples = 0;
+	for (i = 0; i < batch->num; i++) {
+		pthread_mutex_lock(&batch->mutex);
+		while (! batch->file[i].done)
+			pthread_cond_wait(&batch->done, &batch->mutex);
+		pthread_mutex_unlock(&batch->mutex);
+
+		fwrite(batch->file[i].output, 1, batch->file[i].size, stdout);
+		fflush(stdout);
+		samples += batch->file[i].samples;
+		free(batch->file[i].output);
+		free(batch->file[i].name);
+	}
+
+	for (i = 0; i < workers; i++)
+		pthread_join(thread[i], NULL);
+	free(thread);
+	free(batch->file);
+	pthread_mutex_destroy(&batch->mutex);
+	pthread_cond_destroy(&batch->done);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = end.tv_sec - start.tv_sec +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%d files, %ld samples in %.3f seconds: ",
+		batch->num, samples, elapsed);
+	fprintf(stderr, "%.0f samples/sec, %.1f files/sec\n",
+		samples / elapsed, batch->num / elapsed);
+	return 0;
+}
+
+/*
+ * chunked decoding of a single file: each chunk is decoded by a thread,
+ * starting OVERLAP samples before the chunk and ending OVERLAP samples
+ * after it; only the keys that end within the chunk are printed, so that
+ * each key is printed once
+ *
+ * the filters and the protocols have to settle in the initial overlap:
+ * stabilize takes about 0.25 seconds to decay from the maximal value to the
+ * noise, like the sequential decoding does, and a key may have started
+ * before that; the final overlap allows the last run of a key to be output,
+ * which may take up to 10000 samples of silence; 0.5 seconds is enough for
+ * both; background instead learns its bounds at the start of the file, so
+ * each thread first decodes its first LEARNING samples, which contain at
+ * most 10000 values of total silence (counted 1 every 10) and 1000 of noise
+ */
+#define OVERLAP 22050
+#define LEARNING 11100
+
+struct chunk {
+	struct batch *batch;
+	char *name;
+	long start, end, total;
+	char *output;
+	size_t size;
+};
+
+void chunkkey(FILE *out, struct chunk *chunk, long offset, int value,
+		void *protocols_status) {
+	struct key key;
+	char *string;
+
+	if (! protocols_key(value, protocols_status, &key))
+		return;
+	if (chunk->start <= offset && offset < chunk->end) {
+		string = keytostring(&key, ' ', '-');
+		fprintf(out, "%s %ld %s\n", chunk->name, offset, string);
+		free(string);
+	}
+}
+
+void *chunkdecode(void *arg) {
+	struct chunk *chunk;
+	struct batch *batch;
+	FILE *out;
+	struct status status;
+	void *read, *protocols_status;
+	struct chain *chain;
+	int values[BLOCKSIZE], n, i, value;
+	long begin, prefix, stop, position, offset;
+
+	chunk = (struct chunk *) arg;
+	batch = chunk->batch;
+	out = open_memstream(&chunk->output, &chunk->size);
+
+	begin = chunk->start - OVERLAP <= LEARNING ? 0 : chunk->start - OVERLAP;
+	prefix = begin == 0 ? 0 : LEARNING;
+	stop = chunk->end + OVERLAP;
+
+	read = read_init(chunk->name, batch->ascii, &status);
+	if (read == NULL) {
+		fclose(out);
+		return NULL;
+	}
+	chain = chaininit(NULL, batch->ascii, batch->valleyfilter,
+		batch->bestfilters, batch->factor, batch->bound, &status);
+	protocols_status = protocols_init(0, batch->devices,
+		batch->ndevices);
+
+	position = 0;
+	while (! status.ended && position < stop) {
+		if (position == prefix && begin > prefix)
+			position += read_skip(read, begin - prefix, &status);
+		n = BLOCKSIZE;
+		if (position < prefix && n > prefix - position)
+			n = prefix - position;
+		if (n > stop - position)
+			n = stop - position;
+		FILTER_BLOCK(read, values, n, read, &status)
+		position += n;
+
+		n = chainblock(chain, values, n, &status);
+		for (i = 0; i < n; i++) {
+			offset = chainoffset(chain, values[i]);
+			if (offset >= prefix)
+				offset += begin - prefix;
+			chunkkey(out, chunk, offset, values[i],
+				protocols_status);
+		}
+	}
+
+	/* the last runlength value ends with the input */
+	value = chainend(chain, &status);
+	if (chunk->end == chunk->total)
+		chunkkey(out, chunk, chunk->total - 1, value, protocols_status);
+
+	read_end(read, &status);
+	protocols_end(protocols_status);
+	fclose(out);
+	return NULL;
+}
+
+/*
+ * decode a file in chunks in parallel
+ */
+int chunkrun(struct batch *batch, char *filename, int num) {
+	struct status status;
+	void *read;
+	struct chunk *chunk;
+	pthread_t *thread;
+	int *started;
+	struct timespec start, end;
+	double elapsed;
+	long total;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	read = read_init(filename, batch->ascii, &status);
+	if (read == NULL)
+		return -1;
+	total = read_skip(read, LONG_MAX, &status);
+	read_end(read, &status);
+
+	chunk = malloc(num * sizeof(struct chunk));
+	thread = malloc(num * sizeof(pthread_t));
+	started = malloc(num * sizeof(int));
+	for (i = 0; i < num; i++) {
+		chunk[i].batch = batch;
+		chunk[i].name = filename;
+		chunk[i].start = total * i / num;
+		chunk[i].end = total * (i + 1) / num;
+		chunk[i].total = total;
+		chunk[i].output = NULL;
+		chunk[i].size = 0;
+		started[i] = ! pthread_create(&thread[i], NULL, chunkdecode,
+			&chunk[i]);
+		if (! started[i])	/* no thread: decode the chunk here */
+			chunkdecode(&chunk[i]);
+	}
+
+	for (i = 0; i < num; i++) {
+		if (started[i])
+			pthread_join(thread[i], NULL);
+		fwrite(chunk[i].output, 1, chunk[i].size, stdout);
+		free(chunk[i].output);
+	}
+	fflush(stdout);
+	free(thread);
+	free(started);
+	free(chunk);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = end.tv_sec - start.tv_sec +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%d chunks, %ld samples in %.3f seconds: ",
+		num, total, elapsed);
+	fprintf(stderr, "%.0f samples/sec\n", total / elapsed);
+	return 0;
+}
+
+/*
+ * several receivers: each audio device has its own capture thread, chain of
+ * filters and protocols; a single loop waits for all of them by poll() and
+ * prints their keys as they come, each with the name of its device and its
+ * sample offset, like -B does for files; a device ends at the end of input,
+ * which only happens for file:name, either a file or a fifo; all end at
+ * SIGINT or SIGTERM, which are blocked in all threads and received by a
+ * descriptor in the same loop; the counters of each device are then printed
+ */
+#define MAXRECEIVERS 16
+
+struct receiver {
+	char *name;
+	void *microphone;
+	struct chain *chain;
+	void *protocols_status;
+	struct status status;
+	struct microphone_counters counters;
+	long keys;
+	double cputime;
+	int ended;
+};
+
+/*
+ * processor time of the calling thread, in seconds
+ */
+double cputime() {
+	struct timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void receiverkey(struct receiver *receiver, FILE *events,
+		struct keyevent *event) {
+	char *string;
+
+	string = keytostring(&event->key, ' ', '-');
+	printf("%s %ld %s\n", receiver->name, event->end, string);
+	fflush(stdout);
+	free(string);
+	if (events) {
+		fprintf(events, "%s ", receiver->name);
+		printevent(events, event);
+		fflush(events);
+	}
+	receiver->keys++;
+}
+
+/*
+ * end of a receiver: stop its device, and decode the last runlength value,
+ * which ends with the input
+ */
+void receiverend(struct receiver *receiver, FILE *events) {
+	struct keyevent event;
+	int value;
+
+	microphone_counters(receiver->microphone, &receiver->counters);
+	microphone_end(receiver->microphone, &receiver->status);
+	value = chainend(receiver->chain, &receiver->status);
+	if (protocols_event(value, receiver->counters.frames - 1,
+			receiver->protocols_status, &event))
+		receiverkey(receiver, events, &event);
+	protocols_end(receiver->protocols_status);
+	receiver->ended = 1;
+}
+
+int receiversrun(struct batch *batch, char **names, int num,
+		struct microphone_sizes *sizes, int realtime, int adaptive,
+		FILE *events) {
+	struct receiver *receiver, *r;
+	struct pollfd *fds;
+	struct keyevent event;
+	sigset_t signals;
+	int values[BLOCKSIZE], n, i, j, active, opened;
+	double start;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	receiver = malloc(num * sizeof(struct receiver));
+	fds = malloc((num + 1) * sizeof(struct pollfd));
+	fds[num].fd = signalfd(-1, &signals, SFD_CLOEXEC);
+	fds[num].events = POLLIN;
+	active = 0;
+	for (j = 0; j < num; j++) {
+		r = &receiver[j];
+		r->name = names[j];
+		r->keys = 0;
+		r->cputime = 0;
+		r->microphone = microphone_init(r->name, sizes, &r->status);
+		if (r->microphone == NULL) {	/* go on with the others */
+			fprintf(stderr, "cannot open %s\n", r->name);
+			r->ended = 1;
+			continue;
+		}
+		if (realtime > 0)
+			microphone_realtime(r->microphone, realtime);
+		r->chain = chaininit(NULL, batch->ascii, batch->valleyfilter,
+			batch->bestfilters, batch->factor, batch->bound,
+			&r->status);
+		r->protocols_status = protocols_init(0, batch->devices,
+			batch->ndevices);
+		protocols_adaptive(r->protocols_status, adaptive);
+		r->ended = 0;
+		active++;
+	}
+	opened = active;
+
+	while (active > 0) {
+		for (j = 0; j < num; j++) {
+			fds[j].fd = receiver[j].ended ? -1 :
+				microphone_fd(receiver[j].microphone);
+			fds[j].events = POLLIN;
+		}
+		if (poll(fds, num + 1, -1) == -1) {
+			perror("poll");
+			break;
+		}
+		if (fds[num].revents)
+			break;
+
+		for (j = 0; j < num; j++) {
+			if (! fds[j].revents)
+				continue;
+			r = &receiver[j];
+			start = cputime();
+
+			n = BLOCKSIZE;
+			FILTER_BLOCK(microphone, values, n, r->microphone,
+				&r->status)
+			n = chainblock(r->chain, values, n, &r->status);
+			for (i = 0; i < n; i++)
+				if (protocols_event(values[i],
+						chainoffset(r->chain, values[i]),
+						r->protocols_status, &event)) {
+					microphone_keylatency(r->microphone,
+						event.end);
+					receiverkey(r, events, &event);
+				}
+
+			if (r->status.ended) {
+				receiverend(r, events);
+				active--;
+			}
+
+			r->cputime += cputime() - start;
+		}
+	}
+
+	for (j = 0; j < num; j++) {
+		r = &receiver[j];
+		if (r->microphone == NULL)
+			continue;
+		if (! r->ended)		/* stopped by a signal */
+			receiverend(r, events);
+		fprintf(stderr, "%s: %ld keys, ", r->name, r->keys);
+		fprintf(stderr, "decoding time: %.3f seconds\n", r->cputime);
+		microphone_printcounters(stderr, &r->counters);
+	}
+	close(fds[num].fd);
+	free(fds);
+	free(receiver);
+	return opened > 0 ? 0 : -1;
+}
 
 /*
  * main
  */
 int main(int argc, char *argv[]) {
 	int opt;
-	char *filename, *logfile = NULL;
-	int debug, ascii, valleyfilter;
+	char *filename, *logfile = NULL, *batchsource = NULL;
+	char *protocolfile = NULL, *eventfile = NULL;
+	FILE *events = NULL;
+	int debug, ascii, valleyfilter, bestfilters, workers, chunks;
+	int states, adaptive, realtime, nactions, a;
+	char *devices[MAXDEVICES], *receivers[MAXRECEIVERS];
+	int ndevices, nreceivers, d;
+	void *keystate;
+	struct keyaction actions[2];
 	int bound;
 	double factor;
 	struct status status;
-	void *read, *microphone, *log;
-	void *valley, *diff, *amplify, *maximal, *stabilize;
-	void *background, *trigger, *runlength;
-	int value;
+	void *read, *microphone;
+	struct chain *chain;
+	int value, values[BLOCKSIZE], n, i, res;
+	long offset;
 	struct protocols_status *protocols_status;
-	struct key *key;
+	struct keyevent event;
+	struct protocols_counters counters;
+	struct microphone_counters audiocounters;
+	struct microphone_sizes sizes = MICROPHONE_DEFAULT;
+	struct batch batch;
 
 					/* arguments */
 
 	ascii = 0;
 	valleyfilter = 0;
+	bestfilters = 0;
 	debug = 0;
-	while (-1 != (opt = getopt(argc, argv, "fcld:")))
+	workers = sysconf(_SC_NPROCESSORS_ONLN);
+	chunks = 0;
+	states = 0;
+	adaptive = 0;
+	realtime = 0;
+	ndevices = 0;
+	nreceivers = 0;
+	while (-1 != (opt = getopt(argc, argv, "fclbd:p:e:sa:w:R:S:B:j:P:M:")))
 		switch (opt) {
 		case 'l':
 			logfile = "log.au";
@@ -87,15 +825,68 @@ int main(int argc, char *argv[]) {
 		case 'c':
 			valleyfilter = 1;
 			break;
+		case 'b':
+			bestfilters = 1;
+			break;
 		case 'd':
 			debug = atoi(optarg);
 			break;
+		case 'p':
+			protocolfile = optarg;
+			break;
+		case 'e':
+			eventfile = optarg;
+			break;
+		case 's':
+			states = 1;
+			break;
+		case 'a':
+			adaptive = atoi(optarg);
+			break;
+		case 'w':
+			if (ndevices >= MAXDEVICES) {
+				printf("too many devices\n");
+				exit(EXIT_FAILURE);
+			}
+			devices[ndevices++] = optarg;
+			break;
+		case 'R':
+			realtime = atoi(optarg);
+			break;
+		case 'S':
+			if (microphone_sizes(optarg, &sizes)) {
+				printf("invalid sizes: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'B':
+			batchsource = optarg;
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			break;
+		case 'P':
+			chunks = atoi(optarg);
+			break;
+		case 'M':
+			if (nreceivers >= MAXRECEIVERS) {
+				printf("too many audio devices\n");
+				exit(EXIT_FAILURE);
+			}
+			receivers[nreceivers++] = optarg;
+			break;
 		}
 	if (ascii && logfile)
 		logfile = "log.txt";
+	if (workers < 1)
+		workers = 1;
 
 	argc -= optind - 1;
 	argv += optind - 1;
+	if (batchsource != NULL || nreceivers > 0) {	/* no file or device */
+		argc++;
+		argv--;
+	}
 	if (argc - 1 < 1)
 		filename = "default";
 	else
@@ -103,64 +894,136 @@ int main(int argc, char *argv[]) {
 	factor = argc - 1 >= 2 ? atof(argv[2]) : 1;
 	bound = argc - 1 >= 3 ? atoi(argv[3]) : -1;
 
+					/* protocols */
+
+	if (protocols_load(protocolfile))
+		exit(EXIT_FAILURE);
+	for (d = 0; d < ndevices; d++)
+		if (stringtodevice(devices[d], &batch.devices[d])) {
+			printf("invalid device: %s\n", devices[d]);
+			exit(EXIT_FAILURE);
+		}
+	batch.ndevices = ndevices;
+
+					/* batch of files, or chunks of a file */
+
+	batch.ascii = ascii;
+	batch.valleyfilter = valleyfilter;
+	batch.bestfilters = bestfilters;
+	batch.factor = factor;
+	batch.bound = bound;
+	if (batchsource != NULL) {
+		if (batchlist(&batch, batchsource))
+			exit(EXIT_FAILURE);
+		batchrun(&batch, workers);
+		return EXIT_SUCCESS;
+	}
+	if (chunks > 0) {
+		if (chunkrun(&batch, filename, chunks)) {
+			printf("cannot open input file\n");
+			exit(EXIT_FAILURE);
+		}
+		return EXIT_SUCCESS;
+	}
+
+					/* event file */
+
+	if (eventfile != NULL) {
+		events = fopen(eventfile, "w");
+		if (events == NULL) {
+			perror(eventfile);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+					/* several audio devices */
+
+	if (nreceivers > 0) {
+		res = receiversrun(&batch, receivers, nreceivers, &sizes,
+			realtime, adaptive, events);
+		if (events)
+			fclose(events);
+		return res ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
 					/* init filters and protocols */
 
 	read =             read_init(filename, ascii, &status);
 	if (read != NULL)
 		microphone = NULL;
+	else if (access(filename, F_OK) == 0) {	/* file, but not audio */
+		printf("cannot open input file\n");
+		exit(EXIT_FAILURE);
+	}
 	else {
-		microphone = microphone_init(filename, &status);
+		microphone = microphone_init(filename, &sizes, &status);
 		if (microphone == NULL) {
 			printf("cannot open input file\n");
 			exit(EXIT_FAILURE);
 		}
+		if (realtime > 0)
+			microphone_realtime(microphone, realtime);
 	}
-	log =               log_init(logfile, ascii, &status);
-	valley =         valley_init(10, &status);
-	diff =             diff_init(&status);
-	amplify =       amplify_init(factor, &status);
-	maximal =       maximal_init(11, &status);
-	stabilize =   stabilize_init(&status);
-	trigger =       trigger_init(bound, &status);
-	background = background_init(&status);
-	runlength =   runlength_init(&status);
+	chain = chaininit(logfile, ascii, valleyfilter, bestfilters,
+		factor, bound, &status);
+
+	protocols_status = protocols_init(debug, batch.devices,
+		batch.ndevices);
+	protocols_adaptive(protocols_status, adaptive);
+	keystate = keystate_init();
 
-	protocols_status = protocols_init(debug);
-	
 					/* process values */
 
 	while (! status.ended) {
-
-		// filter testing: STOPHERE to cut the pipe of filters short
-
-		value = 0;
+		status.flush = 0;
+		n = BLOCKSIZE;
 		if (read)
-			FILTER_VALUE(read, value, read, &status)
+			FILTER_BLOCK(read, values, n, read, &status)
 		if (microphone)
-			FILTER_VALUE(microphone, value, microphone, &status)
-		FILTER_VALUE(log, value, log, &status)
-		if (valleyfilter)
-			FILTER_VALUE(valley, value, valley, &status);
-		FILTER_VALUE(diff, value, diff, &status)
-		FILTER_VALUE(amplify, value, amplify, &status)
-		FILTER_VALUE(stabilize, value, stabilize, &status)
-		FILTER_VALUE(maximal, value, maximal, &status)
-		if (bound == -1)
-			FILTER_VALUE(background, value, background, &status)
-		else
-			FILTER_VALUE(trigger, value, trigger, &status)
-		FILTER_VALUE(runlength, value, runlength, &status)
-
-		if (! debug) {
-			printf("*");
-			fflush(stdout);
+			FILTER_BLOCK(microphone, values, n, microphone, &status)
+		n = chainblock(chain, values, n, &status);
+
+		for (i = 0; i < n; i++) {
+			if (! debug) {
+				printf("*");
+				fflush(stdout);
+			}
+
+			offset = chainoffset(chain, values[i]);
+			if (protocols_event(values[i], offset, protocols_status,
+					&event)) {
+				if (microphone)
+					microphone_keylatency(microphone,
+						event.end);
+				if (! states) {
+					printf("\n");
+					printkey(&event.key);
+					printf("\n");
+				}
+				if (events) {
+					printevent(events, &event);
+					fflush(events);
+				}
+				nactions = keystate_event(keystate, &event,
+					actions);
+				for (a = 0; a < nactions && states; a++) {
+					printf("\n");
+					printaction(stdout, &actions[a]);
+					fflush(stdout);
+				}
+			}
 		}
 
-		key = protocols_value(value, protocols_status);
-		if (key) {
-			printf("\n");
-			printkey(key);
+		/* release by the input, since in a silence the runlength
+		 * filter outputs nothing for long; not past a key that may
+		 * still be coming */
+		nactions = keystate_time(keystate,
+			protocols_pending(protocols_status, chain->input - 1),
+			actions);
+		for (a = 0; a < nactions && states; a++) {
 			printf("\n");
+			printaction(stdout, &actions[a]);
+			fflush(stdout);
 		}
 	}
 
@@ -168,23 +1031,41 @@ int main(int argc, char *argv[]) {
 
 	if (read)
 		read_end(read, &status);
-	if (microphone)
+	if (microphone) {
+		microphone_counters(microphone, &audiocounters);
 		microphone_end(microphone, &status);
-	log_end(log, &status);
-	valley_end(valley, &status);
-	diff_end(diff, &status);
-	amplify_end(amplify, &status);
-	stabilize_end(stabilize, &status);
-	maximal_end(maximal, &status);
-	trigger_end(trigger, &status);
-	background_end(background, &status);
-	value = runlength_end(runlength, &status);
-	protocols_value(value, protocols_status);
+	}
+	offset = chain->input - 1;
+	value = chainend(chain, &status);
+	if (protocols_event(value, offset, protocols_status, &event)) {
+		if (! states) {		/* the last value may complete a key */
+			printf("\n");
+			printkey(&event.key);
+			printf("\n");
+		}
+		if (events)
+			printevent(events, &event);
+		nactions = keystate_event(keystate, &event, actions);
+		for (a = 0; a < nactions && states; a++) {
+			printf("\n");
+			printaction(stdout, &actions[a]);
+		}
+	}
+	protocols_counters(protocols_status, &counters);
 	protocols_end(protocols_status);
+	if (adaptive > 0)
+		printcounters(stderr, &counters);
+	if (microphone)
+		microphone_printcounters(stderr, &audiocounters);
+	if (keystate_end(keystate, offset, actions) && states) {
+		printf("\n");
+		printaction(stdout, &actions[0]);
+	}
+	if (events)
+		fclose(events);
 
 	if (! debug)
 		printf("\n");
 
 	return EXIT_SUCCESS;
 }
-
@@ -0,0 +1,237 @@
+/*
+ * simdtest.c
+ *
+ * Copyright (C) 2019 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * check the vector kernels of the block filters against the plain loops
+ *
+ * simdtest [file.au]...
+ *
+ * the same input goes through diff, amplify and trigger with each level of
+ * vector instructions the processor has, and the outputs are compared with
+ * the ones without vectors; the input is random samples, samples at the
+ * limits of 16 bits, and the AU files given as arguments; the blocks are of
+ * all sizes from 0 to 40 values and of random sizes up to BLOCKSIZE, so that
+ * each kernel leaves some values to the loop and some blocks are all loop
+ *
+ * exit status is nonzero if any output differs
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "filters.h"
+
+#define MAXINPUT (1 << 20)
+
+/*
+ * the filters under test, with their outputs
+ */
+struct outputs {
+	int *diff;
+	int *amplify;
+	int *trigger;
+	int ndiff;
+};
+
+/*
+ * block sizes: all small ones, then random ones; the same for all levels
+ */
+int blocksize(int block, unsigned int *seed) {
+	if (block <= 40)
+		return block;
+	return rand_r(seed) % (BLOCKSIZE + 1);
+}
+
+/*
+ * run the input through the filters, block by block
+ */
+void run(int *input, int n, double factor, int bound, struct outputs *o) {
+	struct status status;
+	void *diff, *amplify, *trigger;
+	int values[BLOCKSIZE];
+	unsigned int seed;
+	int i, block, size, m;
+
+	status.ended = 0;
+	status.flush = 0;
+	diff = diff_init(&status);
+	amplify = amplify_init(factor, &status);
+	trigger = trigger_init(bound, &status);
+
+	seed = 1;
+	o->ndiff = 0;
+	for (i = 0, block = 0; i < n; i += size, block++) {
+		size = blocksize(block, &seed);
+		if (size > n - i)
+			size = n - i;
+
+		memcpy(values, input + i, size * sizeof(int));
+		m = diff_block(values, size, values, diff, &status);
+
+		memcpy(o->diff + o->ndiff, values, m * sizeof(int));
+		amplify_block(values, m, values, amplify, &status);
+		memcpy(o->amplify + o->ndiff, values, m * sizeof(int));
+		trigger_block(values, m, values, trigger, &status);
+		memcpy(o->trigger + o->ndiff, values, m * sizeof(int));
+		o->ndiff += m;
+	}
+
+	diff_end(diff, &status);
+	amplify_end(amplify, &status);
+	trigger_end(trigger, &status);
+}
+
+/*
+ * compare an output with the one without vectors
+ */
+int compare(char *name, char *filter, int level, int *plain, int *simd,
+		int n) {
+	int i;
+	for (i = 0; i < n; i++)
+		if (plain[i] != simd[i]) {
+			printf("%s: %s differs at level %d, value %d: ",
+				name, filter, level, i);
+			printf("%d instead of %d\n", simd[i], plain[i]);
+			return 1;
+		}
+	return 0;
+}
+
+/*
+ * check an input with some factors and bounds at all levels
+ */
+int check(char *name, int *input, int n) {
+	double factors[] = {1, -1, 0.5, 3.7, -12.25, 1000};
+	int bounds[] = {0, 1, 100, 5000, 70000};
+	struct outputs plain, simd;
+	int f, b, level, top, errors;
+
+	plain.diff = malloc(n * sizeof(int));
+	plain.amplify = malloc(n * sizeof(int));
+	plain.trigger = malloc(n * sizeof(int));
+	simd.diff = malloc(n * sizeof(int));
+	simd.amplify = malloc(n * sizeof(int));
+	simd.trigger = malloc(n * sizeof(int));
+
+	top = filters_simd(-1);
+	errors = 0;
+	for (f = 0; f < (int) (sizeof(factors) / sizeof(factors[0])); f++)
+		for (b = 0; b < (int) (sizeof(bounds) / sizeof(bounds[0]));
+		     b++) {
+			filters_simd(0);
+			run(input, n, factors[f], bounds[b], &plain);
+			for (level = 1; level <= top; level++) {
+				filters_simd(level);
+				run(input, n, factors[f], bounds[b], &simd);
+				if (simd.ndiff != plain.ndiff) {
+					printf("%s: %d values instead of %d\n",
+						name, simd.ndiff, plain.ndiff);
+					errors++;
+					continue;
+				}
+				errors += compare(name, "diff", level,
+					plain.diff, simd.diff, plain.ndiff);
+				errors += compare(name, "amplify", level,
+					plain.amplify, simd.amplify,
+					plain.ndiff);
+				errors += compare(name, "trigger", level,
+					plain.trigger, simd.trigger,
+					plain.ndiff);
+			}
+		}
+	filters_simd(-1);
+
+	printf("%s: %d values, levels 1 to %d: %s\n",
+		name, n, top, errors ? "DIFFER" : "ok");
+
+	free(plain.diff);
+	free(plain.amplify);
+	free(plain.trigger);
+	free(simd.diff);
+	free(simd.amplify);
+	free(simd.trigger);
+	return errors;
+}
+
+/*
+ * read the samples of an AU file
+ */
+int readfile(char *name, int *input) {
+	struct status status;
+	void *read;
+	int n, m;
+
+	read = read_init(name, 0, &status);
+	if (read == NULL)
+		return -1;
+	for (n = 0; ! status.ended && n < MAXINPUT; n += m) {
+		m = MAXINPUT - n < BLOCKSIZE ? MAXINPUT - n : BLOCKSIZE;
+		m = read_block(NULL, m, input + n, read, &status);
+	}
+	read_end(read, &status);
+	return n;
+}
+
+/*
+ * main
+ */
+int main(int argc, char *argv[]) {
+	int *input;
+	unsigned int seed;
+	int i, n, errors;
+
+	input = malloc(MAXINPUT * sizeof(int));
+	errors = 0;
+
+				/* random samples */
+
+	seed = 1;
+	n = 200000;
+	for (i = 0; i < n; i++)
+		input[i] = (int16_t) rand_r(&seed);
+	errors += check("random", input, n);
+
+				/* limits of 16 bits, alternating */
+
+	for (i = 0; i < n; i++)
+		input[i] = (i / (1 + i % 7)) % 2 ? INT16_MAX : INT16_MIN;
+	errors += check("limits", input, n);
+
+				/* around zero and the bounds */
+
+	for (i = 0; i < n; i++)
+		input[i] = (int) (rand_r(&seed) % 11) - 5 +
+			(i % 3 == 0 ? 100 : i % 3 == 1 ? -5000 : 0);
+	errors += check("bounds", input, n);
+
+				/* files */
+
+	for (i = 1; i < argc; i++) {
+		n = readfile(argv[i], input);
+		if (n < 0) {
+			errors++;
+			continue;
+		}
+		errors += check(argv[i], input, n);
+	}
+
+	free(input);
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}